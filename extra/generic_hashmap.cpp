@@ -0,0 +1,405 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+// Open addressing map with linear probing and backward shift deletion, the
+// same design as the (x, y) map in hashmap.cpp, but generic over the key and
+// value types. Whether a slot is full is kept in a separate bitset, so every
+// key value is valid (the (x, y) map reserves x == -1 for empty slots).
+//
+// Keys and values are stored in separate arrays of raw memory, constructed in
+// place. When both types are trivially copyable, moving an entry to another
+// slot (rehash, deletion) is a plain memcpy, otherwise it's a move construction
+// followed by destruction of the source.
+
+uint64_t hash_mix(uint64_t h) {
+  // MurmurHash3 finalizer
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+template <typename K> struct DefaultHash {
+  static_assert(std::is_integral<K>::value || std::is_enum<K>::value,
+                "no default hash for this key type");
+  uint64_t operator()(K key) const { return hash_mix((uint64_t)key); }
+};
+
+template <> struct DefaultHash<std::string> {
+  uint64_t operator()(const std::string &key) const {
+    // FNV-1a, then mixed so the low bits are usable as the bin
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+      h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return hash_mix(h);
+  }
+};
+
+typedef struct {
+  int x;
+  int y;
+} Point;
+
+bool operator==(const Point &a, const Point &b) {
+  return a.x == b.x && a.y == b.y;
+}
+
+template <> struct DefaultHash<Point> {
+  uint64_t operator()(const Point &key) const {
+    return hash_mix((uint64_t)(uint32_t)key.x << 32 | (uint32_t)key.y);
+  }
+};
+
+template <typename K> struct DefaultEq {
+  bool operator()(const K &a, const K &b) const { return a == b; }
+};
+
+template <typename K, typename V, typename Hash = DefaultHash<K>,
+          typename Eq = DefaultEq<K>>
+struct HashMap {
+  K *keys;
+  V *values;
+  // one bit per slot
+  uint64_t *full;
+  int occupied;
+  int len;
+  Hash hash;
+  Eq eq;
+};
+
+// both types can be moved between slots with memcpy
+template <typename K, typename V> constexpr bool trivial_slots() {
+  return std::is_trivially_copyable<K>::value &&
+         std::is_trivially_copyable<V>::value;
+}
+
+template <typename K, typename V, typename H, typename E>
+bool slot_full(const HashMap<K, V, H, E> *map, int slot) {
+  return (map->full[slot >> 6] >> (slot & 63)) & 1;
+}
+
+template <typename K, typename V, typename H, typename E>
+void slot_mark(HashMap<K, V, H, E> *map, int slot, bool full) {
+  uint64_t bit = (uint64_t)1 << (slot & 63);
+  if (full) {
+    map->full[slot >> 6] |= bit;
+  } else {
+    map->full[slot >> 6] &= ~bit;
+  }
+}
+
+// move the entry in `src` into the empty slot `dst` of `dst_map`, `src` is
+// left empty (but still marked, the caller handles the bitsets)
+template <typename K, typename V, typename H, typename E>
+void slot_relocate(HashMap<K, V, H, E> *dst_map, int dst,
+                   HashMap<K, V, H, E> *src_map, int src) {
+  if constexpr (trivial_slots<K, V>()) {
+    memcpy((void *)&dst_map->keys[dst], &src_map->keys[src], sizeof(K));
+    memcpy((void *)&dst_map->values[dst], &src_map->values[src], sizeof(V));
+  } else {
+    new (&dst_map->keys[dst]) K(std::move(src_map->keys[src]));
+    new (&dst_map->values[dst]) V(std::move(src_map->values[src]));
+    src_map->keys[src].~K();
+    src_map->values[src].~V();
+  }
+}
+
+template <typename K, typename V, typename H, typename E>
+void slot_destroy(HashMap<K, V, H, E> *map, int slot) {
+  if constexpr (!trivial_slots<K, V>()) {
+    map->keys[slot].~K();
+    map->values[slot].~V();
+  }
+}
+
+// capacity must be power-of-two
+template <typename K, typename V, typename H, typename E>
+void map_with_capacity(HashMap<K, V, H, E> *map, int capacity) {
+  assert(map->keys == NULL);
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+  map->keys = (K *)malloc(capacity * sizeof(K));
+  map->values = (V *)malloc(capacity * sizeof(V));
+  int words = (capacity + 63) / 64;
+  map->full = (uint64_t *)calloc(words, sizeof(uint64_t));
+  map->occupied = 0;
+  map->len = capacity;
+}
+
+template <typename K, typename V, typename H, typename E>
+void map_free(HashMap<K, V, H, E> *map) {
+  for (int i = 0; i < map->len; i++) {
+    if (slot_full(map, i)) {
+      slot_destroy(map, i);
+    }
+  }
+  free(map->keys);
+  free(map->values);
+  free(map->full);
+  map->keys = NULL;
+  map->values = NULL;
+  map->full = NULL;
+  map->occupied = 0;
+  map->len = 0;
+}
+
+// the slot holding `key`, or the empty slot where it would go
+template <typename K, typename V, typename H, typename E>
+int map_find_slot(const HashMap<K, V, H, E> *map, const K &key) {
+  int mask = map->len - 1;
+  int bin = (int)(map->hash(key) & mask);
+  for (int i = 0; i < map->len; i++) {
+    int slot = (bin + i) & mask;
+    if (!slot_full(map, slot) || map->eq(map->keys[slot], key)) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+template <typename K, typename V, typename H, typename E>
+V *map_find(HashMap<K, V, H, E> *map, const K &key) {
+  if (map->len == 0) {
+    return NULL;
+  }
+  int slot = map_find_slot(map, key);
+  if (slot < 0 || !slot_full(map, slot)) {
+    return NULL;
+  }
+  return &map->values[slot];
+}
+
+template <typename K, typename V, typename H, typename E>
+void map_resize(HashMap<K, V, H, E> *map, int new_capacity) {
+  HashMap<K, V, H, E> bigger = {};
+  bigger.hash = map->hash;
+  bigger.eq = map->eq;
+  map_with_capacity(&bigger, new_capacity);
+  for (int i = 0; i < map->len; i++) {
+    if (slot_full(map, i)) {
+      int slot = map_find_slot(&bigger, map->keys[i]);
+      slot_relocate(&bigger, slot, map, i);
+      slot_mark(&bigger, slot, true);
+      bigger.occupied++;
+    }
+  }
+  free(map->keys);
+  free(map->values);
+  free(map->full);
+  *map = bigger;
+}
+
+// grow the map once so that `count` keys fit without further resizes
+template <typename K, typename V, typename H, typename E>
+void map_reserve(HashMap<K, V, H, E> *map, int count) {
+  int capacity = 8;
+  while (count > capacity / 2) {
+    capacity *= 2;
+  }
+  if (map->len == 0) {
+    map_with_capacity(map, capacity);
+  } else if (capacity > map->len) {
+    map_resize(map, capacity);
+  }
+}
+
+template <typename K, typename V, typename H, typename E>
+void map_insert(HashMap<K, V, H, E> *map, const K &key, const V &value) {
+  map_reserve(map, map->occupied + 1);
+  int slot = map_find_slot(map, key);
+  if (slot_full(map, slot)) {
+    map->values[slot] = value;
+    return;
+  }
+  new (&map->keys[slot]) K(key);
+  new (&map->values[slot]) V(value);
+  slot_mark(map, slot, true);
+  map->occupied++;
+}
+
+// backward shift deletion, see map_remove in hashmap.cpp
+template <typename K, typename V, typename H, typename E>
+bool map_remove(HashMap<K, V, H, E> *map, const K &key) {
+  if (map->len == 0) {
+    return false;
+  }
+  int hole = map_find_slot(map, key);
+  if (hole < 0 || !slot_full(map, hole)) {
+    return false;
+  }
+  slot_destroy(map, hole);
+
+  int mask = map->len - 1;
+  int i = hole;
+  while (true) {
+    i = (i + 1) & mask;
+    if (!slot_full(map, i)) {
+      break;
+    }
+    int home = (int)(map->hash(map->keys[i]) & mask);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      slot_relocate(map, hole, map, i);
+      hole = i;
+    }
+  }
+
+  slot_mark(map, hole, false);
+  map->occupied--;
+  return true;
+}
+
+// benchmarks
+
+uint64_t rng_next(uint64_t *state) {
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct PointHash {
+  size_t operator()(const Point &p) const { return DefaultHash<Point>()(p); }
+};
+
+struct Timings {
+  double insert;
+  double hit;
+  double miss;
+  double remove;
+};
+
+void print_timings(const char *name, const Timings *t) {
+  printf("  %-20s %8.1f %8.1f %8.1f %8.1f\n", name, t->insert, t->hit,
+         t->miss, t->remove);
+}
+
+// ns per operation for `count` keys, `missing` holds keys that are never
+// inserted
+template <typename K>
+void bench_generic(const char *title, const K *keys, const K *missing,
+                   int count) {
+  int64_t checksum = 0;
+  Timings ours = {};
+  Timings theirs = {};
+
+  HashMap<K, int> map = {};
+  int64_t start = now_ns();
+  for (int i = 0; i < count; i++) {
+    map_insert(&map, keys[i], i);
+  }
+  ours.insert = (double)(now_ns() - start) / count;
+  start = now_ns();
+  for (int i = 0; i < count; i++) {
+    int *value = map_find(&map, keys[i]);
+    checksum += value ? *value : 0;
+  }
+  ours.hit = (double)(now_ns() - start) / count;
+  start = now_ns();
+  for (int i = 0; i < count; i++) {
+    checksum += map_find(&map, missing[i]) != NULL;
+  }
+  ours.miss = (double)(now_ns() - start) / count;
+  start = now_ns();
+  for (int i = 0; i < count; i++) {
+    checksum += map_remove(&map, keys[i]);
+  }
+  ours.remove = (double)(now_ns() - start) / count;
+  assert(map.occupied == 0);
+  map_free(&map);
+
+  typedef typename std::conditional<std::is_same<K, Point>::value, PointHash,
+                                    std::hash<K>>::type StdHash;
+  std::unordered_map<K, int, StdHash> std_map;
+  start = now_ns();
+  for (int i = 0; i < count; i++) {
+    std_map[keys[i]] = i;
+  }
+  theirs.insert = (double)(now_ns() - start) / count;
+  start = now_ns();
+  for (int i = 0; i < count; i++) {
+    auto it = std_map.find(keys[i]);
+    checksum += it != std_map.end() ? it->second : 0;
+  }
+  theirs.hit = (double)(now_ns() - start) / count;
+  start = now_ns();
+  for (int i = 0; i < count; i++) {
+    checksum += std_map.find(missing[i]) != std_map.end();
+  }
+  theirs.miss = (double)(now_ns() - start) / count;
+  start = now_ns();
+  for (int i = 0; i < count; i++) {
+    checksum += std_map.erase(keys[i]);
+  }
+  theirs.remove = (double)(now_ns() - start) / count;
+
+  printf("%s, %d keys (ns/op)\n", title, count);
+  printf("  %-20s %8s %8s %8s %8s\n", "", "insert", "hit", "miss", "remove");
+  print_timings("HashMap", &ours);
+  print_timings("std::unordered_map", &theirs);
+  printf("  checksum %lld\n", (long long)checksum);
+}
+
+int main(int argc, char *argv[]) {
+  int count = argc > 1 ? atoi(argv[1]) : 1 << 20;
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+  // grid coordinates, including negative ones
+  Point *points = (Point *)malloc(count * sizeof(Point));
+  Point *missing_points = (Point *)malloc(count * sizeof(Point));
+  int side = 1;
+  while (side * side < count) {
+    side++;
+  }
+  for (int i = 0; i < count; i++) {
+    points[i] = Point{i / side - side / 2, i % side - side / 2};
+    missing_points[i] = Point{i / side + side, i % side};
+  }
+  bench_generic("Point keys", points, missing_points, count);
+  free(points);
+  free(missing_points);
+
+  uint64_t *ints = (uint64_t *)calloc(count, sizeof(uint64_t));
+  uint64_t *missing_ints = (uint64_t *)calloc(count, sizeof(uint64_t));
+  for (int i = 0; i < count; i++) {
+    // even keys are stored, odd ones are missing
+    ints[i] = rng_next(&rng) & ~(uint64_t)1;
+    missing_ints[i] = rng_next(&rng) | 1;
+  }
+  bench_generic("uint64_t keys", ints, missing_ints, count);
+  free(ints);
+  free(missing_ints);
+
+  // not trivially copyable, exercises the move path
+  int string_count = count / 4;
+  std::string *strings = new std::string[string_count];
+  std::string *missing_strings = new std::string[string_count];
+  for (int i = 0; i < string_count; i++) {
+    strings[i] = "review-" + std::to_string(rng_next(&rng) & ~(uint64_t)1);
+    missing_strings[i] = "review-" + std::to_string(rng_next(&rng) | 1);
+  }
+  bench_generic("std::string keys", strings, missing_strings, string_count);
+  delete[] strings;
+  delete[] missing_strings;
+
+  return EXIT_SUCCESS;
+}
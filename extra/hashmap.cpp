@@ -1,7 +1,16 @@
-
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef struct {
   int x;
@@ -9,6 +18,11 @@ typedef struct {
   int value;
 } Entry;
 
+typedef struct {
+  int x;
+  int y;
+} Key;
+
 typedef struct {
   Entry *entries;
   int occupied;
@@ -25,30 +39,39 @@ void map_with_capacity(HashMap *map, int capacity) {
   map->len = capacity;
 }
 
-void map_insert(HashMap *map, int x, int y, int value);
-void map_resize(HashMap *map, int new_capacity) {
-  HashMap bigger = {};
-  map_with_capacity(&bigger, new_capacity);
-  for (int i = 0; i < map->len; i++) {
-    Entry entry = map->entries[i];
-    if (entry.x != -1) {
-      map_insert(&bigger, entry.x, entry.y, entry.value);
-    }
-  }
+void map_free(HashMap *map) {
   free(map->entries);
-  *map = bigger;
+  *map = {};
 }
 
-Entry *map_find_entry(HashMap *map, int x, int y) {
+// both coordinates packed into one 64-bit key, no overflow for any int pair
+uint64_t map_key(int x, int y) {
+  return (uint64_t)(uint32_t)x << 32 | (uint32_t)y;
+}
+
+// MurmurHash3 finalizer, every input bit affects every output bit, so the low
+// bits used as the bin index are as good as the high ones even for grid keys
+// https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
+uint64_t map_hash(int x, int y) {
+  uint64_t h = map_key(x, y);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// lookup with the hash already computed, see map_find_batch
+Entry *map_find_entry_hashed(HashMap *map, int x, int y, uint64_t hash) {
   if (map->len == 0) {
     return NULL;
   }
-  int hash = (x + y) * (x + y + 1) / 2 + x;
   int mask = map->len - 1;
   // modulo to entry count, len is always power of two so this works
-  int bin = hash & mask;
+  int bin = (int)(hash & mask);
   for (int i = 0; i < map->len; i++) {
-    Entry *entry = &map->entries[(hash + i) & mask];
+    Entry *entry = &map->entries[(bin + i) & mask];
     if (entry->x == -1 || (entry->x == x && entry->y == y)) {
       return entry;
     }
@@ -56,21 +79,1161 @@ Entry *map_find_entry(HashMap *map, int x, int y) {
   return NULL;
 }
 
+Entry *map_find_entry(HashMap *map, int x, int y) {
+  return map_find_entry_hashed(map, x, y, map_hash(x, y));
+}
+
+// insert without checking the load factor, the caller must make sure that
+// there is a free entry
+void map_place_hashed(HashMap *map, int x, int y, int value, uint64_t hash) {
+  Entry *entry = map_find_entry_hashed(map, x, y, hash);
+  assert(entry != NULL);
+  if (entry->x == -1) {
+    map->occupied++;
+  }
+  entry->x = x;
+  entry->y = y;
+  entry->value = value;
+}
+
+void map_place(HashMap *map, int x, int y, int value) {
+  map_place_hashed(map, x, y, value, map_hash(x, y));
+}
+
+void map_resize(HashMap *map, int new_capacity) {
+  HashMap bigger = {};
+  map_with_capacity(&bigger, new_capacity);
+  for (int i = 0; i < map->len; i++) {
+    Entry entry = map->entries[i];
+    if (entry.x != -1) {
+      map_place(&bigger, entry.x, entry.y, entry.value);
+    }
+  }
+  free(map->entries);
+  *map = bigger;
+}
+
 void map_insert(HashMap *map, int x, int y, int value) {
   if (map->len == 0) {
     map_with_capacity(map, 8);
-  } else if (map->occupied > map->len / 2) {
+  } else if (map->occupied + 1 > map->len / 2) {
     map_resize(map, map->len * 2);
   }
+  map_place(map, x, y, value);
+}
+
+// grow the map once so that `count` keys fit without further resizes
+void map_reserve(HashMap *map, int count) {
+  int capacity = 8;
+  while (count > capacity / 2) {
+    capacity *= 2;
+  }
+  if (map->len == 0) {
+    map_with_capacity(map, capacity);
+  } else if (capacity > map->len) {
+    map_resize(map, capacity);
+  }
+}
+
+constexpr int BUILD_PARTITION_BITS = 11;
+
+// Insert many entries at once. The map is sized up front and the entries are
+// partitioned by the top bits of their bin, so the table is filled one small
+// region after another instead of at random. Later duplicates of a key
+// overwrite earlier ones.
+void map_build(HashMap *map, const Entry *entries, int count) {
+  map_reserve(map, map->occupied + count);
+
+  int mask = map->len - 1;
+  int len_bits = __builtin_ctz(map->len);
+  int partition_bits =
+      len_bits < BUILD_PARTITION_BITS ? len_bits : BUILD_PARTITION_BITS;
+  int shift = len_bits - partition_bits;
+  int partitions = 1 << partition_bits;
+
+  int *bins = (int *)malloc(count * sizeof(int));
+  int *offsets = (int *)calloc(partitions + 1, sizeof(int));
+  for (int i = 0; i < count; i++) {
+    bins[i] = (int)(map_hash(entries[i].x, entries[i].y) & mask);
+    offsets[(bins[i] >> shift) + 1]++;
+  }
+  for (int i = 0; i < partitions; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+
+  Entry *sorted = (Entry *)malloc(count * sizeof(Entry));
+  int *sorted_bins = (int *)malloc(count * sizeof(int));
+  for (int i = 0; i < count; i++) {
+    int dst = offsets[bins[i] >> shift]++;
+    sorted[dst] = entries[i];
+    sorted_bins[dst] = bins[i];
+  }
+
+  for (int i = 0; i < count; i++) {
+    const Entry *entry = &sorted[i];
+    map_place_hashed(map, entry->x, entry->y, entry->value, sorted_bins[i]);
+  }
+
+  free(sorted_bins);
+  free(sorted);
+  free(offsets);
+  free(bins);
+}
+
+constexpr int PREFETCH_DISTANCE = 16;
+
+// Look up many keys at once, found[i] is set to the value of keys[i] or NULL.
+// The bin of the key PREFETCH_DISTANCE places ahead is prefetched, so the
+// cache misses of consecutive lookups overlap. Returns the number of hits.
+int map_find_batch(HashMap *map, const Key *keys, int count, int **found) {
+  if (map->len == 0) {
+    memset(found, 0, count * sizeof(int *));
+    return 0;
+  }
+
+  int mask = map->len - 1;
+  uint64_t hashes[PREFETCH_DISTANCE];
+  for (int i = 0; i < PREFETCH_DISTANCE && i < count; i++) {
+    hashes[i] = map_hash(keys[i].x, keys[i].y);
+    __builtin_prefetch(&map->entries[hashes[i] & mask]);
+  }
+
+  int hits = 0;
+  for (int i = 0; i < count; i++) {
+    uint64_t hash = hashes[i % PREFETCH_DISTANCE];
+    int ahead = i + PREFETCH_DISTANCE;
+    if (ahead < count) {
+      uint64_t ahead_hash = map_hash(keys[ahead].x, keys[ahead].y);
+      hashes[ahead % PREFETCH_DISTANCE] = ahead_hash;
+      __builtin_prefetch(&map->entries[ahead_hash & mask]);
+    }
+
+    Entry *entry = map_find_entry_hashed(map, keys[i].x, keys[i].y, hash);
+    if (entry == NULL || entry->x == -1) {
+      found[i] = NULL;
+    } else {
+      found[i] = &entry->value;
+      hits++;
+    }
+  }
+  return hits;
+}
+
+// Linear probing deletion without tombstones, after emptying the entry we walk
+// the rest of the probe chain and move back every entry that may legally live
+// in the hole, so lookups never stop early at a gap.
+// https://en.wikipedia.org/wiki/Linear_probing#Deletion
+bool map_remove(HashMap *map, int x, int y) {
   Entry *entry = map_find_entry(map, x, y);
-  entry->x = x;
-  entry->y = y;
-  entry->value = value;
+  if (entry == NULL || entry->x == -1) {
+    return false;
+  }
+
+  int mask = map->len - 1;
+  int hole = entry - map->entries;
+  int i = hole;
+  while (true) {
+    i = (i + 1) & mask;
+    Entry *next = &map->entries[i];
+    if (next->x == -1) {
+      break;
+    }
+    // the entry can be moved back unless its home bin lies cyclically
+    // in (hole, i]
+    int home = (int)(map_hash(next->x, next->y) & mask);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      map->entries[hole] = *next;
+      hole = i;
+    }
+  }
+
+  memset(&map->entries[hole], -1, sizeof(Entry));
+  map->occupied--;
+  return true;
+}
+
+// Probe length histogram, histogram[n] counts the stored keys a lookup finds
+// after inspecting n entries. Longer probes are counted in the last bucket.
+void map_probe_histogram(HashMap *map, int *histogram, int buckets) {
+  memset(histogram, 0, buckets * sizeof(int));
+  int mask = map->len - 1;
+  for (int i = 0; i < map->len; i++) {
+    Entry *entry = &map->entries[i];
+    if (entry->x == -1) {
+      continue;
+    }
+    int home = (int)(map_hash(entry->x, entry->y) & mask);
+    int probes = ((i - home) & mask) + 1;
+    histogram[probes < buckets ? probes : buckets - 1]++;
+  }
+}
+
+// Swiss table layout
+// https://abseil.io/about/design/swisstables
+//
+// Keys and values live in their own arrays, next to them is an array of
+// control bytes, one per slot. A control byte is either EMPTY, DELETED or the
+// low 7 bits of the hash of the key in that slot. Slots are grouped by 16, a
+// lookup compares the hash fragment against a whole group at once and only
+// touches the keys whose fragment matched. Groups are aligned, so a probe
+// sequence can stop at the first group that still has an EMPTY byte.
+
+constexpr int8_t CTRL_EMPTY = -128;
+constexpr int8_t CTRL_DELETED = -2;
+constexpr int GROUP_WIDTH = 16;
+
+typedef struct {
+  int8_t *ctrl;
+  Key *keys;
+  int *values;
+  // full + deleted slots, deleted slots still lengthen probe sequences
+  int occupied;
+  int live;
+  int len;
+} SwissMap;
+
+int swiss_group(uint64_t hash, int group_mask) {
+  return (int)(hash >> 7) & group_mask;
+}
+
+int8_t swiss_fragment(uint64_t hash) { return (int8_t)(hash & 0x7f); }
+
+// bitmask of the slots in the group whose control byte is `byte`
+uint32_t group_match(const int8_t *group, int8_t byte) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] == byte) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+// bitmask of the EMPTY and DELETED slots, both have the top bit set
+uint32_t group_match_free(const int8_t *group) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *)group);
+  return _mm_movemask_epi8(ctrl);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] < 0) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+// capacity must be power-of-two
+void map_with_capacity(SwissMap *map, int capacity) {
+  assert(map->ctrl == NULL);
+  if (capacity < GROUP_WIDTH) {
+    capacity = GROUP_WIDTH;
+  }
+  map->ctrl = (int8_t *)aligned_alloc(GROUP_WIDTH, capacity);
+  memset(map->ctrl, CTRL_EMPTY, capacity);
+  map->keys = (Key *)malloc(capacity * sizeof(Key));
+  map->values = (int *)malloc(capacity * sizeof(int));
+  map->occupied = 0;
+  map->live = 0;
+  map->len = capacity;
+}
+
+void map_free(SwissMap *map) {
+  free(map->ctrl);
+  free(map->keys);
+  free(map->values);
+  *map = {};
+}
+
+// returns the slot holding (x, y) or -1
+int swiss_find_slot(SwissMap *map, int x, int y) {
+  if (map->len == 0) {
+    return -1;
+  }
+  uint64_t hash = map_hash(x, y);
+  int8_t fragment = swiss_fragment(hash);
+  int group_mask = map->len / GROUP_WIDTH - 1;
+  int group = swiss_group(hash, group_mask);
+  // triangular probing over groups visits every group once
+  for (int step = 1; step <= group_mask + 1; step++) {
+    const int8_t *ctrl = map->ctrl + group * GROUP_WIDTH;
+    uint32_t candidates = group_match(ctrl, fragment);
+    while (candidates != 0) {
+      int slot = group * GROUP_WIDTH + __builtin_ctz(candidates);
+      Key *key = &map->keys[slot];
+      if (key->x == x && key->y == y) {
+        return slot;
+      }
+      candidates &= candidates - 1;
+    }
+    if (group_match(ctrl, CTRL_EMPTY) != 0) {
+      return -1;
+    }
+    group = (group + step) & group_mask;
+  }
+  return -1;
+}
+
+int *map_find(SwissMap *map, int x, int y) {
+  int slot = swiss_find_slot(map, x, y);
+  return slot < 0 ? NULL : &map->values[slot];
 }
 
-void map_remove(HashMap *map, int x, int y, int value) {
+int *map_find(HashMap *map, int x, int y) {
   Entry *entry = map_find_entry(map, x, y);
-  if (entry) {
-    entry->x = -1;
+  return (entry == NULL || entry->x == -1) ? NULL : &entry->value;
+}
+
+// insert without checking the load factor, the caller must make sure that
+// there is a free slot
+void map_place(SwissMap *map, int x, int y, int value) {
+  int slot = swiss_find_slot(map, x, y);
+  if (slot >= 0) {
+    map->values[slot] = value;
+    return;
+  }
+
+  uint64_t hash = map_hash(x, y);
+  int group_mask = map->len / GROUP_WIDTH - 1;
+  int group = swiss_group(hash, group_mask);
+  for (int step = 1;; step++) {
+    uint32_t free_slots = group_match_free(map->ctrl + group * GROUP_WIDTH);
+    if (free_slots != 0) {
+      slot = group * GROUP_WIDTH + __builtin_ctz(free_slots);
+      break;
+    }
+    assert(step <= group_mask + 1);
+    group = (group + step) & group_mask;
+  }
+
+  if (map->ctrl[slot] == CTRL_EMPTY) {
+    map->occupied++;
+  }
+  map->live++;
+  map->ctrl[slot] = swiss_fragment(hash);
+  map->keys[slot] = Key{x, y};
+  map->values[slot] = value;
+}
+
+void map_resize(SwissMap *map, int new_capacity) {
+  SwissMap bigger = {};
+  map_with_capacity(&bigger, new_capacity);
+  for (int i = 0; i < map->len; i++) {
+    if (map->ctrl[i] >= 0) {
+      map_place(&bigger, map->keys[i].x, map->keys[i].y, map->values[i]);
+    }
+  }
+  map_free(map);
+  *map = bigger;
+}
+
+void map_insert(SwissMap *map, int x, int y, int value) {
+  if (map->len == 0) {
+    map_with_capacity(map, GROUP_WIDTH);
+  } else if (map->occupied + 1 > map->len / 8 * 7) {
+    // mostly tombstones, rehashing in place is enough
+    if (map->live + 1 <= map->len / 2) {
+      map_resize(map, map->len);
+    } else {
+      map_resize(map, map->len * 2);
+    }
+  }
+  map_place(map, x, y, value);
+}
+
+bool map_remove(SwissMap *map, int x, int y) {
+  int slot = swiss_find_slot(map, x, y);
+  if (slot < 0) {
+    return false;
+  }
+  // a probe sequence never passes a group with an EMPTY slot, so the slot
+  // can be emptied outright unless the group is otherwise full
+  const int8_t *group = map->ctrl + slot / GROUP_WIDTH * GROUP_WIDTH;
+  if (group_match(group, CTRL_EMPTY) != 0) {
+    map->ctrl[slot] = CTRL_EMPTY;
+    map->occupied--;
+  } else {
+    map->ctrl[slot] = CTRL_DELETED;
+  }
+  map->live--;
+  return true;
+}
+
+// Like the HashMap histogram, but counts the groups a lookup inspects.
+void map_probe_histogram(SwissMap *map, int *histogram, int buckets) {
+  memset(histogram, 0, buckets * sizeof(int));
+  int group_mask = map->len / GROUP_WIDTH - 1;
+  for (int i = 0; i < map->len; i++) {
+    if (map->ctrl[i] < 0) {
+      continue;
+    }
+    uint64_t hash = map_hash(map->keys[i].x, map->keys[i].y);
+    int group = swiss_group(hash, group_mask);
+    int probes = 1;
+    while (group != i / GROUP_WIDTH) {
+      group = (group + probes) & group_mask;
+      probes++;
+    }
+    histogram[probes < buckets ? probes : buckets - 1]++;
+  }
+}
+
+// Sharded map for sharing one table between threads
+//
+// The top bits of the hash pick one of 2^shard_bits shards, each shard is an
+// ordinary HashMap (which bins by the low bits) with its own lock and its own
+// resizing. Writers take the shard lock. Readers take no lock, they follow the
+// seqlock protocol: the writer makes the sequence odd while it modifies the
+// table and even again when it is done, a reader retries whenever the sequence
+// was odd or changed while it was probing.
+// https://en.wikipedia.org/wiki/Seqlock
+//
+// A resize builds the bigger table aside and publishes it with a single
+// pointer store. Readers may still be probing the old table, so it is not
+// freed until sharded_free. The tables grow geometrically, so the retired ones
+// take less memory than the live one.
+
+constexpr int CACHE_LINE = 64;
+
+typedef struct alignas(CACHE_LINE) {
+  pthread_mutex_t lock;
+  unsigned sequence;
+  HashMap *table;
+  HashMap **retired;
+  int retired_count;
+} Shard;
+
+typedef struct {
+  Shard *shards;
+  int shard_bits;
+} ShardedMap;
+
+HashMap *table_with_capacity(int capacity) {
+  HashMap *table = (HashMap *)calloc(1, sizeof(HashMap));
+  map_with_capacity(table, capacity);
+  return table;
+}
+
+void table_free(HashMap *table) {
+  map_free(table);
+  free(table);
+}
+
+void sharded_init(ShardedMap *map, int shard_bits) {
+  int count = 1 << shard_bits;
+  map->shard_bits = shard_bits;
+  map->shards = (Shard *)aligned_alloc(CACHE_LINE, count * sizeof(Shard));
+  for (int i = 0; i < count; i++) {
+    Shard *shard = &map->shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->sequence = 0;
+    shard->table = table_with_capacity(8);
+    shard->retired = NULL;
+    shard->retired_count = 0;
+  }
+}
+
+void sharded_free(ShardedMap *map) {
+  int count = 1 << map->shard_bits;
+  for (int i = 0; i < count; i++) {
+    Shard *shard = &map->shards[i];
+    for (int j = 0; j < shard->retired_count; j++) {
+      table_free(shard->retired[j]);
+    }
+    free(shard->retired);
+    table_free(shard->table);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(map->shards);
+  *map = {};
+}
+
+Shard *sharded_shard(ShardedMap *map, uint64_t hash) {
+  if (map->shard_bits == 0) {
+    return &map->shards[0];
+  }
+  return &map->shards[hash >> (64 - map->shard_bits)];
+}
+
+bool sharded_find(ShardedMap *map, int x, int y, int *value) {
+  uint64_t hash = map_hash(x, y);
+  Shard *shard = sharded_shard(map, hash);
+  while (true) {
+    unsigned begin = __atomic_load_n(&shard->sequence, __ATOMIC_ACQUIRE);
+    if (begin & 1) {
+      // the writer holds the shard, let it finish
+      sched_yield();
+      continue;
+    }
+
+    // a published table never changes its entries pointer or length, only
+    // the entries themselves may be torn, which the sequence check catches
+    HashMap *table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+    int mask = table->len - 1;
+    int bin = (int)(hash & mask);
+    bool found = false;
+    int result = 0;
+    for (int i = 0; i < table->len; i++) {
+      Entry *entry = &table->entries[(bin + i) & mask];
+      int entry_x = __atomic_load_n(&entry->x, __ATOMIC_RELAXED);
+      int entry_y = __atomic_load_n(&entry->y, __ATOMIC_RELAXED);
+      if (entry_x == -1) {
+        break;
+      }
+      if (entry_x == x && entry_y == y) {
+        result = __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+        found = true;
+        break;
+      }
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shard->sequence, __ATOMIC_RELAXED) == begin) {
+      if (found) {
+        *value = result;
+      }
+      return found;
+    }
+  }
+}
+
+void shard_write_begin(Shard *shard) {
+  __atomic_store_n(&shard->sequence, shard->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void shard_write_end(Shard *shard) {
+  __atomic_store_n(&shard->sequence, shard->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Writes to a published table race with the loads in sharded_find, so every
+// entry field is stored atomically. Relaxed is enough, the sequence orders them.
+void entry_store(Entry *entry, int x, int y, int value) {
+  __atomic_store_n(&entry->x, x, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->y, y, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->value, value, __ATOMIC_RELAXED);
+}
+
+// map_place_hashed for a table readers may be looking at
+void shard_place(HashMap *table, int x, int y, int value, uint64_t hash) {
+  Entry *entry = map_find_entry_hashed(table, x, y, hash);
+  assert(entry != NULL);
+  if (entry->x == -1) {
+    table->occupied++;
+  }
+  entry_store(entry, x, y, value);
+}
+
+// map_remove for a table readers may be looking at
+bool shard_remove(HashMap *table, int x, int y) {
+  Entry *entry = map_find_entry(table, x, y);
+  if (entry == NULL || entry->x == -1) {
+    return false;
+  }
+
+  int mask = table->len - 1;
+  int hole = entry - table->entries;
+  int i = hole;
+  while (true) {
+    i = (i + 1) & mask;
+    Entry *next = &table->entries[i];
+    if (next->x == -1) {
+      break;
+    }
+    int home = (int)(map_hash(next->x, next->y) & mask);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      entry_store(&table->entries[hole], next->x, next->y, next->value);
+      hole = i;
+    }
+  }
+
+  entry_store(&table->entries[hole], -1, -1, -1);
+  table->occupied--;
+  return true;
+}
+
+void sharded_insert(ShardedMap *map, int x, int y, int value) {
+  uint64_t hash = map_hash(x, y);
+  Shard *shard = sharded_shard(map, hash);
+  pthread_mutex_lock(&shard->lock);
+
+  HashMap *table = shard->table;
+  if (table->occupied + 1 > table->len / 2) {
+    HashMap *bigger = table_with_capacity(table->len * 2);
+    for (int i = 0; i < table->len; i++) {
+      Entry entry = table->entries[i];
+      if (entry.x != -1) {
+        map_place(bigger, entry.x, entry.y, entry.value);
+      }
+    }
+    __atomic_store_n(&shard->table, bigger, __ATOMIC_RELEASE);
+
+    shard->retired = (HashMap **)realloc(
+        shard->retired, (shard->retired_count + 1) * sizeof(HashMap *));
+    shard->retired[shard->retired_count++] = table;
+    table = bigger;
+  }
+
+  shard_write_begin(shard);
+  shard_place(table, x, y, value, hash);
+  shard_write_end(shard);
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+bool sharded_remove(ShardedMap *map, int x, int y) {
+  Shard *shard = sharded_shard(map, map_hash(x, y));
+  pthread_mutex_lock(&shard->lock);
+  shard_write_begin(shard);
+  bool removed = shard_remove(shard->table, x, y);
+  shard_write_end(shard);
+  pthread_mutex_unlock(&shard->lock);
+  return removed;
+}
+
+// benchmarks
+
+uint64_t rng_next(uint64_t *state) {
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// smallest probe length such that at least `percentile` of the keys are found
+// within it
+int histogram_percentile(const int *histogram, int buckets, double percentile) {
+  int64_t total = 0;
+  for (int i = 0; i < buckets; i++) {
+    total += histogram[i];
+  }
+  int64_t seen = 0;
+  for (int i = 0; i < buckets; i++) {
+    seen += histogram[i];
+    if ((double)seen >= percentile * (double)total) {
+      return i;
+    }
+  }
+  return buckets - 1;
+}
+
+// longest probe length present in the histogram
+int histogram_max(const int *histogram, int buckets) {
+  for (int i = buckets - 1; i > 0; i--) {
+    if (histogram[i] != 0) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+constexpr int PROBE_BUCKETS = 1024;
+constexpr int GRID_SIZE = 4096;
+
+// Keep `live` random grid keys in the map and replace one of them per cycle,
+// reporting the probe length distribution of the live keys as we go.
+void bench_churn(int live, int cycles) {
+  HashMap map = {};
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+  Entry *keys = (Entry *)malloc(live * sizeof(Entry));
+  int *histogram = (int *)malloc(PROBE_BUCKETS * sizeof(int));
+
+  for (int i = 0; i < live; i++) {
+    Entry key;
+    do {
+      key.x = rng_next(&rng) % GRID_SIZE;
+      key.y = rng_next(&rng) % GRID_SIZE;
+      key.value = i;
+      Entry *found = map_find_entry(&map, key.x, key.y);
+      if (found == NULL || found->x == -1) {
+        break;
+      }
+    } while (true);
+    keys[i] = key;
+    map_insert(&map, key.x, key.y, key.value);
+  }
+
+  printf("%10s %9s %9s %6s %4s %4s %4s %8s\n", "cycles", "occupied", "len",
+         "load", "p50", "p99", "max", "ns/cycle");
+
+  int report_every = cycles / 10 > 0 ? cycles / 10 : 1;
+  int64_t start = now_ns();
+  for (int cycle = 1; cycle <= cycles; cycle++) {
+    int victim = rng_next(&rng) % live;
+    bool removed = map_remove(&map, keys[victim].x, keys[victim].y);
+    assert(removed);
+
+    Entry key;
+    do {
+      key.x = rng_next(&rng) % GRID_SIZE;
+      key.y = rng_next(&rng) % GRID_SIZE;
+      key.value = cycle;
+      Entry *found = map_find_entry(&map, key.x, key.y);
+      if (found->x == -1) {
+        break;
+      }
+    } while (true);
+    keys[victim] = key;
+    map_insert(&map, key.x, key.y, key.value);
+
+    if (cycle % report_every == 0) {
+      int64_t elapsed = now_ns() - start;
+
+      map_probe_histogram(&map, histogram, PROBE_BUCKETS);
+      printf("%10d %9d %9d %6.3f %4d %4d %4d %8.1f\n", cycle, map.occupied,
+             map.len, (double)map.occupied / map.len,
+             histogram_percentile(histogram, PROBE_BUCKETS, 0.5),
+             histogram_percentile(histogram, PROBE_BUCKETS, 0.99),
+             histogram_max(histogram, PROBE_BUCKETS),
+             (double)elapsed / report_every);
+      start = now_ns();
+    }
+  }
+
+  // every live key must still be reachable
+  assert(map.occupied == live);
+  for (int i = 0; i < live; i++) {
+    Entry *entry = map_find_entry(&map, keys[i].x, keys[i].y);
+    assert(entry && entry->x == keys[i].x && entry->value == keys[i].value);
+  }
+
+  free(histogram);
+  free(keys);
+  map_free(&map);
+}
+
+// square of grid keys with `count` cells, x-major
+Key *grid_keys(int count, int offset) {
+  Key *keys = (Key *)malloc(count * sizeof(Key));
+  int side = 1;
+  while (side * side < count) {
+    side++;
+  }
+  for (int i = 0; i < count; i++) {
+    keys[i] = Key{offset + i / side, offset + i % side};
+  }
+  return keys;
+}
+
+void shuffle_keys(Key *keys, int count, uint64_t *rng) {
+  for (int i = count - 1; i > 0; i--) {
+    int j = rng_next(rng) % (i + 1);
+    Key tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+// ns per lookup over `keys`, the sum of found values goes to `checksum`
+template <typename Map>
+double bench_lookups(Map *map, const Key *keys, int count, int64_t *checksum) {
+  int64_t start = now_ns();
+  int64_t sum = 0;
+  for (int i = 0; i < count; i++) {
+    int *value = map_find(map, keys[i].x, keys[i].y);
+    sum += value ? *value : -1;
+  }
+  *checksum += sum;
+  return (double)(now_ns() - start) / count;
+}
+
+// Lookups of grid coordinates in a fixed size table filled to a given load
+// factor, linear probing vs the Swiss table layout, both on map_hash.
+void bench_layouts(int capacity) {
+  const double loads[] = {0.5, 0.625, 0.75, 0.875};
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  int64_t checksum = 0;
+
+  printf("%6s %10s %12s %12s %12s %12s\n", "load", "keys", "linear hit",
+         "linear miss", "swiss hit", "swiss miss");
+  for (int l = 0; l < (int)(sizeof(loads) / sizeof(loads[0])); l++) {
+    int count = (int)(loads[l] * capacity);
+    Key *hits = grid_keys(count, 0);
+    // a grid shifted past the stored one, none of these are present
+    Key *misses = grid_keys(count, 1 << 14);
+    shuffle_keys(hits, count, &rng);
+    shuffle_keys(misses, count, &rng);
+
+    HashMap linear = {};
+    map_with_capacity(&linear, capacity);
+    SwissMap swiss = {};
+    map_with_capacity(&swiss, capacity);
+    for (int i = 0; i < count; i++) {
+      map_place(&linear, hits[i].x, hits[i].y, i);
+      map_place(&swiss, hits[i].x, hits[i].y, i);
+    }
+
+    double linear_hit = bench_lookups(&linear, hits, count, &checksum);
+    double linear_miss = bench_lookups(&linear, misses, count, &checksum);
+    double swiss_hit = bench_lookups(&swiss, hits, count, &checksum);
+    double swiss_miss = bench_lookups(&swiss, misses, count, &checksum);
+    printf("%6.3f %10d %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n", loads[l], count,
+           linear_hit, linear_miss, swiss_hit, swiss_miss);
+
+    map_free(&linear);
+    map_free(&swiss);
+    free(hits);
+    free(misses);
+  }
+  printf("checksum %lld\n", (long long)checksum);
+}
+
+template <typename Map>
+void print_histogram(const char *name, Map *map, int count) {
+  int histogram[PROBE_BUCKETS];
+  map_probe_histogram(map, histogram, PROBE_BUCKETS);
+  int max = histogram_max(histogram, PROBE_BUCKETS);
+  printf("%s: %d keys in %d slots, p50 %d, p99 %d, max %d\n", name, count,
+         map->len, histogram_percentile(histogram, PROBE_BUCKETS, 0.5),
+         histogram_percentile(histogram, PROBE_BUCKETS, 0.99), max);
+  for (int i = 1; i <= max; i++) {
+    if (histogram[i] != 0) {
+      printf("  %4d%s %d\n", i, i == PROBE_BUCKETS - 1 ? "+" : " ",
+             histogram[i]);
+    }
+  }
+}
+
+// Loading and looking up many random keys, one at a time vs the bulk API.
+void bench_bulk(int count) {
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  Entry *entries = (Entry *)malloc(count * sizeof(Entry));
+  Key *keys = (Key *)malloc(count * sizeof(Key));
+  int **found = (int **)malloc(count * sizeof(int *));
+  for (int i = 0; i < count; i++) {
+    entries[i] = Entry{(int)(rng_next(&rng) >> 40), (int)(rng_next(&rng) >> 40), i};
+    keys[i] = Key{entries[i].x, entries[i].y};
+  }
+  shuffle_keys(keys, count, &rng);
+  int64_t checksum = 0;
+
+  HashMap inserted = {};
+  int64_t start = now_ns();
+  for (int i = 0; i < count; i++) {
+    map_insert(&inserted, entries[i].x, entries[i].y, entries[i].value);
+  }
+  double insert_ns = (double)(now_ns() - start) / count;
+
+  HashMap reserved = {};
+  start = now_ns();
+  map_reserve(&reserved, count);
+  for (int i = 0; i < count; i++) {
+    map_insert(&reserved, entries[i].x, entries[i].y, entries[i].value);
+  }
+  double reserve_ns = (double)(now_ns() - start) / count;
+
+  HashMap built = {};
+  start = now_ns();
+  map_build(&built, entries, count);
+  double build_ns = (double)(now_ns() - start) / count;
+  assert(built.occupied == inserted.occupied);
+
+  double find_ns = bench_lookups(&built, keys, count, &checksum);
+
+  start = now_ns();
+  int hits = map_find_batch(&built, keys, count, found);
+  double batch_ns = (double)(now_ns() - start) / count;
+  assert(hits == count);
+  for (int i = 0; i < count; i++) {
+    checksum += *found[i];
+  }
+
+  printf("%d keys, %d slots\n", count, built.len);
+  printf("  map_insert          %6.1f ns/key\n", insert_ns);
+  printf("  map_reserve+insert  %6.1f ns/key\n", reserve_ns);
+  printf("  map_build           %6.1f ns/key\n", build_ns);
+  printf("  map_find            %6.1f ns/key\n", find_ns);
+  printf("  map_find_batch      %6.1f ns/key\n", batch_ns);
+  printf("checksum %lld\n", (long long)checksum);
+
+  map_free(&inserted);
+  map_free(&reserved);
+  map_free(&built);
+  free(found);
+  free(keys);
+  free(entries);
+}
+
+typedef struct {
+  ShardedMap *map;
+  pthread_barrier_t *barrier;
+  int key_range;
+  int operations;
+  // out of 100
+  int write_percent;
+  uint64_t seed;
+  int64_t checksum;
+} ShardedWorker;
+
+void *sharded_worker(void *arg) {
+  ShardedWorker *worker = (ShardedWorker *)arg;
+  uint64_t rng = worker->seed;
+  int64_t checksum = 0;
+  pthread_barrier_wait(worker->barrier);
+  for (int i = 0; i < worker->operations; i++) {
+    uint64_t r = rng_next(&rng);
+    // the key comes from bits 8 and up, the percentage from the top 24 bits
+    // so that it is close to uniform, and bit 7 picks insert or remove
+    int key = (int)((r >> 8) % worker->key_range);
+    int x = key >> 10;
+    int y = key & 1023;
+    if ((int)((r >> 40) % 100) < worker->write_percent) {
+      if (r & 0x80) {
+        sharded_insert(worker->map, x, y, i);
+      } else {
+        sharded_remove(worker->map, x, y);
+      }
+    } else {
+      int value;
+      if (sharded_find(worker->map, x, y, &value)) {
+        checksum += value;
+      }
+    }
   }
-}
\ No newline at end of file
+  worker->checksum = checksum;
+  return NULL;
+}
+
+// Throughput of a shared map under a read-mostly and a write-heavy mix, for a
+// growing number of threads.
+void bench_sharded(int shard_bits, int operations) {
+  const int write_percents[] = {5, 50};
+  const int key_range = 1 << 20;
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    cores = 1;
+  }
+
+  printf("%d shards, %d keys, %d operations per thread\n", 1 << shard_bits,
+         key_range, operations);
+  printf("%8s %8s %10s\n", "writes", "threads", "Mops/s");
+  for (int w = 0; w < 2; w++) {
+    for (int threads = 1;; threads *= 2) {
+      if (threads > cores) {
+        threads = cores;
+      }
+
+      ShardedMap map = {};
+      sharded_init(&map, shard_bits);
+      for (int key = 0; key < key_range; key += 2) {
+        sharded_insert(&map, key >> 10, key & 1023, key);
+      }
+
+      pthread_barrier_t barrier;
+      pthread_barrier_init(&barrier, NULL, threads + 1);
+      pthread_t *handles = (pthread_t *)malloc(threads * sizeof(pthread_t));
+      ShardedWorker *workers =
+          (ShardedWorker *)malloc(threads * sizeof(ShardedWorker));
+      for (int t = 0; t < threads; t++) {
+        ShardedWorker *worker = &workers[t];
+        worker->map = &map;
+        worker->barrier = &barrier;
+        worker->key_range = key_range;
+        worker->operations = operations;
+        worker->write_percent = write_percents[w];
+        worker->seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+        worker->checksum = 0;
+        if (pthread_create(&handles[t], NULL, sharded_worker, worker) != 0) {
+          fprintf(stderr, "pthread_create failed\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      pthread_barrier_wait(&barrier);
+      int64_t start = now_ns();
+      for (int t = 0; t < threads; t++) {
+        pthread_join(handles[t], NULL);
+      }
+      int64_t elapsed = now_ns() - start;
+
+      printf("%7d%% %8d %10.2f\n", write_percents[w], threads,
+             (double)operations * threads / elapsed * 1000.0);
+
+      free(workers);
+      free(handles);
+      pthread_barrier_destroy(&barrier);
+      sharded_free(&map);
+
+      if (threads == cores) {
+        break;
+      }
+    }
+  }
+}
+
+typedef struct {
+  ShardedMap *map;
+  pthread_barrier_t *barrier;
+  int key_range;
+  int operations;
+  bool writer;
+  uint64_t seed;
+  int64_t hits;
+  int64_t torn;
+} StressWorker;
+
+// the low 20 bits of every stored value are the key it was stored under, so a
+// reader can tell when it got a value put together from two entries
+int stress_value(int key, int round) { return (round & 0x7ff) << 20 | key; }
+
+void *stress_worker(void *arg) {
+  StressWorker *worker = (StressWorker *)arg;
+  uint64_t rng = worker->seed;
+  pthread_barrier_wait(worker->barrier);
+  for (int i = 0; i < worker->operations; i++) {
+    uint64_t r = rng_next(&rng);
+    int key = (int)((r >> 8) % worker->key_range);
+    int x = key >> 10;
+    int y = key & 1023;
+    if (worker->writer) {
+      if (r & 1) {
+        sharded_insert(worker->map, x, y, stress_value(key, i));
+      } else {
+        sharded_remove(worker->map, x, y);
+      }
+    } else {
+      int value;
+      if (sharded_find(worker->map, x, y, &value)) {
+        worker->hits++;
+        if ((value & 0xfffff) != key) {
+          worker->torn++;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+// Readers looking up keys while writers insert, remove and grow the same few
+// shards. Every value found has to belong to the key it was found under.
+// Returns false when a reader saw a torn entry.
+bool stress_sharded(int threads, int operations) {
+  const int key_range = 4096;
+  if (threads < 2) {
+    threads = 2;
+  }
+  int writers = threads / 2;
+
+  ShardedMap map = {};
+  sharded_init(&map, 1);
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, threads);
+  pthread_t *handles = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  StressWorker *workers =
+      (StressWorker *)malloc(threads * sizeof(StressWorker));
+  for (int t = 0; t < threads; t++) {
+    StressWorker *worker = &workers[t];
+    worker->map = &map;
+    worker->barrier = &barrier;
+    worker->key_range = key_range;
+    worker->operations = operations;
+    worker->writer = t < writers;
+    worker->seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+    worker->hits = 0;
+    worker->torn = 0;
+    if (pthread_create(&handles[t], NULL, stress_worker, worker) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  int64_t hits = 0;
+  int64_t torn = 0;
+  for (int t = 0; t < threads; t++) {
+    pthread_join(handles[t], NULL);
+    hits += workers[t].hits;
+    torn += workers[t].torn;
+  }
+  printf("%d writers, %d readers, %lld hits, %lld torn\n", writers,
+         threads - writers, (long long)hits, (long long)torn);
+
+  free(workers);
+  free(handles);
+  pthread_barrier_destroy(&barrier);
+  sharded_free(&map);
+  return torn == 0;
+}
+
+// Probe length distribution of a real key set, read as "x y" pairs from
+// stdin, or of a square grid of `count` keys when no input is given.
+void bench_histogram(int count, bool from_stdin) {
+  HashMap linear = {};
+  SwissMap swiss = {};
+  if (from_stdin) {
+    int x, y;
+    count = 0;
+    while (scanf("%d %d", &x, &y) == 2) {
+      map_insert(&linear, x, y, count);
+      map_insert(&swiss, x, y, count);
+      count++;
+    }
+  } else {
+    Key *keys = grid_keys(count, 0);
+    for (int i = 0; i < count; i++) {
+      map_insert(&linear, keys[i].x, keys[i].y, i);
+      map_insert(&swiss, keys[i].x, keys[i].y, i);
+    }
+    free(keys);
+  }
+  print_histogram("linear (entries)", &linear, linear.occupied);
+  print_histogram("swiss (groups)", &swiss, swiss.live);
+  map_free(&linear);
+  map_free(&swiss);
+}
+
+int main(int argc, char *argv[]) {
+  const char *mode = argc > 1 ? argv[1] : "churn";
+  if (strcmp(mode, "churn") == 0) {
+    int live = argc > 2 ? atoi(argv[2]) : 100000;
+    int cycles = argc > 3 ? atoi(argv[3]) : 5000000;
+    bench_churn(live, cycles);
+  } else if (strcmp(mode, "layouts") == 0) {
+    int capacity = argc > 2 ? atoi(argv[2]) : 1 << 20;
+    bench_layouts(capacity);
+  } else if (strcmp(mode, "histogram") == 0) {
+    bool from_stdin = argc > 2 && strcmp(argv[2], "-") == 0;
+    int count = argc > 2 && !from_stdin ? atoi(argv[2]) : 1 << 20;
+    bench_histogram(count, from_stdin);
+  } else if (strcmp(mode, "bulk") == 0) {
+    int count = argc > 2 ? atoi(argv[2]) : 1 << 20;
+    bench_bulk(count);
+  } else if (strcmp(mode, "sharded") == 0) {
+    int shard_bits = argc > 2 ? atoi(argv[2]) : 6;
+    int operations = argc > 3 ? atoi(argv[3]) : 2000000;
+    bench_sharded(shard_bits, operations);
+  } else if (strcmp(mode, "stress") == 0) {
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    int operations = argc > 3 ? atoi(argv[3]) : 1000000;
+    if (!stress_sharded(threads, operations)) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    fprintf(stderr,
+            "usage: %s churn [live] [cycles]\n"
+            "       %s layouts [capacity]\n"
+            "       %s histogram [count | -]\n"
+            "       %s bulk [count]\n"
+            "       %s sharded [shard_bits] [operations]\n"
+            "       %s stress [threads] [operations]\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -3,27 +3,253 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 constexpr int MAP_MAX = 200;
 #endif /* __PROGTEST__ */
+#include <stdint.h>
+#include <string.h>
+
+// A map with runtime dimensions. Cells are stored x-major, like the
+// altitude[x][y] arrays, with a row stride of exactly `height`. Altitudes that
+// fit into 16 bits are stored as such, which halves the memory the engines go
+// through.
+typedef struct {
+  // extent of x
+  int width;
+  // extent of y
+  int height;
+  // 2 or 4
+  int cell_bytes;
+  void *cells;
+} Grid;
+
+void grid_init(Grid *grid, int width, int height, int cell_bytes) {
+  assert(cell_bytes == 2 || cell_bytes == 4);
+  grid->width = width;
+  grid->height = height;
+  grid->cell_bytes = cell_bytes;
+  grid->cells = calloc((size_t)width * height, cell_bytes);
+}
+
+void grid_free(Grid *grid) {
+  free(grid->cells);
+  grid->cells = NULL;
+}
+
+int grid_get(const Grid *grid, int x, int y) {
+  size_t index = (size_t)x * grid->height + y;
+  if (grid->cell_bytes == 2) {
+    return ((const int16_t *)grid->cells)[index];
+  }
+  return ((const int32_t *)grid->cells)[index];
+}
+
+void grid_set(Grid *grid, int x, int y, int value) {
+  size_t index = (size_t)x * grid->height + y;
+  if (grid->cell_bytes == 2) {
+    assert(value >= INT16_MIN && value <= INT16_MAX);
+    ((int16_t *)grid->cells)[index] = (int16_t)value;
+  } else {
+    ((int32_t *)grid->cells)[index] = value;
+  }
+}
+
+// copy the cells with the given x into `row`, `height` values
+void grid_read_row(const Grid *grid, int x, int *row) {
+  size_t start = (size_t)x * grid->height;
+  if (grid->cell_bytes == 2) {
+    const int16_t *cells = (const int16_t *)grid->cells + start;
+    for (int y = 0; y < grid->height; y++) {
+      row[y] = cells[y];
+    }
+  } else {
+    memcpy(row, (const int32_t *)grid->cells + start,
+           grid->height * sizeof(int));
+  }
+}
+
+int cell_bytes_for(int min_value, int max_value) {
+  return (min_value >= INT16_MIN && max_value <= INT16_MAX) ? 2 : 4;
+}
+
+size_t grid_footprint(const Grid *grid) {
+  return sizeof(Grid) + (size_t)grid->width * grid->height * grid->cell_bytes;
+}
+
+void grid_from_map(Grid *grid, int map[][MAP_MAX], int size) {
+  int min_value = INT_MAX;
+  int max_value = INT_MIN;
+  for (int x = 0; x < size; x++) {
+    for (int y = 0; y < size; y++) {
+      if (map[x][y] < min_value) {
+        min_value = map[x][y];
+      }
+      if (map[x][y] > max_value) {
+        max_value = map[x][y];
+      }
+    }
+  }
+  grid_init(grid, size, size, cell_bytes_for(min_value, max_value));
+  for (int x = 0; x < size; x++) {
+    for (int y = 0; y < size; y++) {
+      grid_set(grid, x, y, map[x][y]);
+    }
+  }
+}
+
+void grid_to_map(const Grid *grid, int map[][MAP_MAX]) {
+  for (int x = 0; x < grid->width; x++) {
+    for (int y = 0; y < grid->height; y++) {
+      map[x][y] = grid_get(grid, x, y);
+    }
+  }
+}
+
+// Reach of every cell under its own altitude: how many cells in each
+// direction are lower than it before the first one that is at least as high,
+// or the edge. Stored in the layout of Grid, 2 bytes per direction.
+typedef struct {
+  int width;
+  int height;
+  // towards -x, +x, -y and +y
+  uint16_t *left;
+  uint16_t *right;
+  uint16_t *up;
+  uint16_t *down;
+} ReachTable;
+
+void reach_init(ReachTable *reach, int width, int height) {
+  assert(width - 1 <= UINT16_MAX && height - 1 <= UINT16_MAX);
+  size_t cells = (size_t)width * height;
+  reach->width = width;
+  reach->height = height;
+  reach->left = (uint16_t *)malloc(cells * sizeof(uint16_t));
+  reach->right = (uint16_t *)malloc(cells * sizeof(uint16_t));
+  reach->up = (uint16_t *)malloc(cells * sizeof(uint16_t));
+  reach->down = (uint16_t *)malloc(cells * sizeof(uint16_t));
+}
+
+void reach_free(ReachTable *reach) {
+  free(reach->left);
+  free(reach->right);
+  free(reach->up);
+  free(reach->down);
+}
+
+size_t reach_footprint(const ReachTable *reach) {
+  return sizeof(ReachTable) +
+         (size_t)reach->width * reach->height * 4 * sizeof(uint16_t);
+}
+
+// Reach of the n cells of one line, going towards the lower indices into
+// back[] and towards the higher ones into forward[], both with `stride`
+// between neighbours. The stack keeps the cells that are not yet known to be
+// shadowed by a higher one, which makes it decreasing from bottom to top.
+void reach_line(const int *line, int n, int *stack, uint16_t *back,
+                uint16_t *forward, size_t stride) {
+  int top = 0;
+  for (int i = 0; i < n; i++) {
+    while (top > 0 && line[stack[top - 1]] < line[i]) {
+      top--;
+    }
+    back[i * stride] = (uint16_t)(top > 0 ? i - stack[top - 1] - 1 : i);
+    stack[top++] = i;
+  }
+  top = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    while (top > 0 && line[stack[top - 1]] < line[i]) {
+      top--;
+    }
+    forward[i * stride] =
+        (uint16_t)(top > 0 ? stack[top - 1] - i - 1 : n - 1 - i);
+    stack[top++] = i;
+  }
+}
+
+// O(width * height), one pass per row and column
+void reach_build(ReachTable *reach, const Grid *altitude) {
+  int width = altitude->width;
+  int height = altitude->height;
+  int longest = width > height ? width : height;
+  int *line = (int *)malloc(longest * sizeof(int));
+  int *stack = (int *)malloc(longest * sizeof(int));
+
+  for (int x = 0; x < width; x++) {
+    size_t start = (size_t)x * height;
+    grid_read_row(altitude, x, line);
+    reach_line(line, height, stack, reach->up + start, reach->down + start, 1);
+  }
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      line[x] = grid_get(altitude, x, y);
+    }
+    reach_line(line, width, stack, reach->left + y, reach->right + y, height);
+  }
+
+  free(line);
+  free(stack);
+}
+
+// Bound of the cells lower than `alt` going from (x, y) along x, the cell
+// itself isn't checked. Without a reach table this walks cell by cell. With
+// one, every lower cell lets us skip over its whole reach, because everything
+// in there is lower still. So only the cells that are at least as high as all
+// before them get visited, and for the altitude of the cell itself the table
+// already holds the answer.
+int find_x_bound(int x, int y, int dx, int alt, const Grid *altitude,
+                 const ReachTable *reach) {
+  if (reach) {
+    const uint16_t *jumps = dx < 0 ? reach->left : reach->right;
+    if (grid_get(altitude, x, y) == alt) {
+      return x + dx * jumps[(size_t)x * altitude->height + y];
+    }
+    while (true) {
+      int next = x + dx;
+      if (next < 0 || next >= altitude->width ||
+          grid_get(altitude, next, y) >= alt) {
+        return x;
+      }
+      x = next + dx * jumps[(size_t)next * altitude->height + y];
+    }
+  }
 
-int find_x_bound(int x, int y, int dx, int size, int alt,
-                 int altitude[][MAP_MAX]) {
   int prev = x;
   while (true) {
     x += dx;
-    if (x < 0 || x >= size || altitude[x][y] >= alt) {
+    if (x < 0 || x >= altitude->width || grid_get(altitude, x, y) >= alt) {
       return prev;
     }
     prev = x;
   }
 }
 
-int find_y_bound(int x, int y, int dy, int size, int alt,
-                 int altitude[][MAP_MAX]) {
+int find_y_bound(int x, int y, int dy, int alt, const Grid *altitude,
+                 const ReachTable *reach) {
+  if (reach) {
+    const uint16_t *jumps = dy < 0 ? reach->up : reach->down;
+    size_t column = (size_t)x * altitude->height;
+    if (grid_get(altitude, x, y) == alt) {
+      return y + dy * jumps[column + y];
+    }
+    while (true) {
+      int next = y + dy;
+      if (next < 0 || next >= altitude->height ||
+          grid_get(altitude, x, next) >= alt) {
+        return y;
+      }
+      y = next + dy * jumps[column + next];
+    }
+  }
+
   int prev = y;
   while (true) {
     y += dy;
-    if (y < 0 || y >= size || altitude[x][y] >= alt) {
+    if (y < 0 || y >= altitude->height || grid_get(altitude, x, y) >= alt) {
       return prev;
     }
     prev = y;
@@ -59,37 +285,60 @@ void make_convex(int min_array[], int max_array[], int start, int end,
   }
 }
 
-int rectangle_size(int x, int y, int size, int altitude[][MAP_MAX]) {
-  int alt = altitude[x][y];
+// bound arrays of rectangle_size, allocated once per map instead of per cell
+typedef struct {
+  int *x_min_arr;
+  int *x_max_arr;
+  int *y_min_arr;
+  int *y_max_arr;
+} BoundScratch;
+
+void scratch_init(BoundScratch *scratch, const Grid *altitude) {
+  scratch->x_min_arr = (int *)malloc(altitude->width * sizeof(int));
+  scratch->x_max_arr = (int *)malloc(altitude->width * sizeof(int));
+  scratch->y_min_arr = (int *)malloc(altitude->height * sizeof(int));
+  scratch->y_max_arr = (int *)malloc(altitude->height * sizeof(int));
+}
+
+void scratch_free(BoundScratch *scratch) {
+  free(scratch->x_min_arr);
+  free(scratch->x_max_arr);
+  free(scratch->y_min_arr);
+  free(scratch->y_max_arr);
+}
+
+int rectangle_size(int x, int y, const Grid *altitude, const ReachTable *reach,
+                   BoundScratch *scratch) {
+  int alt = grid_get(altitude, x, y);
 
-  int x_min_arr[MAP_MAX] = {};
-  int x_max_arr[MAP_MAX] = {};
-  int y_min_arr[MAP_MAX] = {};
-  int y_max_arr[MAP_MAX] = {};
+  int *x_min_arr = scratch->x_min_arr;
+  int *x_max_arr = scratch->x_max_arr;
+  int *y_min_arr = scratch->y_min_arr;
+  int *y_max_arr = scratch->y_max_arr;
 
-  int x_min = find_x_bound(x, y, -1, size, alt, altitude);
-  int x_max = find_x_bound(x, y, 1, size, alt, altitude);
+  int x_min = find_x_bound(x, y, -1, alt, altitude, reach);
+  int x_max = find_x_bound(x, y, 1, alt, altitude, reach);
   for (int x_ = x_min; x_ <= x_max; x_++) {
-    x_min_arr[x_] = find_y_bound(x_, y, -1, size, alt, altitude);
-    x_max_arr[x_] = find_y_bound(x_, y, 1, size, alt, altitude);
+    x_min_arr[x_] = find_y_bound(x_, y, -1, alt, altitude, reach);
+    x_max_arr[x_] = find_y_bound(x_, y, 1, alt, altitude, reach);
   }
   make_convex(x_min_arr, x_max_arr, x_min, x_max, x);
 
   int y_min = x_min_arr[x];
   int y_max = x_max_arr[x];
   for (int y_ = y_min; y_ <= y_max; y_++) {
-    y_min_arr[y_] = find_x_bound(x, y_, -1, size, alt, altitude);
-    y_max_arr[y_] = find_x_bound(x, y_, 1, size, alt, altitude);
+    y_min_arr[y_] = find_x_bound(x, y_, -1, alt, altitude, reach);
+    y_max_arr[y_] = find_x_bound(x, y_, 1, alt, altitude, reach);
   }
   make_convex(y_min_arr, y_max_arr, y_min, y_max, y);
 
   // printf("\n");
   // printf("Raw\n");
-  // for (int y_ = 0; y_ < size; y_++) {
-  //   for (int x_ = 0; x_ < size; x_++) {
+  // for (int y_ = 0; y_ < altitude->height; y_++) {
+  //   for (int x_ = 0; x_ < altitude->width; x_++) {
   //     if (x_ == x && y_ == y) {
   //       printf(" x");
-  //     } else if (altitude[x_][y_] < alt) {
+  //     } else if (grid_get(altitude, x_, y_) < alt) {
   //       printf(" .");
   //     } else {
   //       printf(" *");
@@ -98,8 +347,8 @@ int rectangle_size(int x, int y, int size, int altitude[][MAP_MAX]) {
   //   printf("\n");
   // }
   // printf("Convex\n");
-  // for (int y_ = 0; y_ < size; y_++) {
-  //   for (int x_ = 0; x_ < size; x_++) {
+  // for (int y_ = 0; y_ < altitude->height; y_++) {
+  //   for (int x_ = 0; x_ < altitude->width; x_++) {
   //     if (x_ == x && y_ == y) {
   //       printf(" x");
   //     } else if (x_ >= x_min && x_ <= x_max && y_ >= y_min && y_ <= y_max &&
@@ -113,8 +362,8 @@ int rectangle_size(int x, int y, int size, int altitude[][MAP_MAX]) {
   //   printf("\n");
   // }
   // printf("\n");
-  // for (int y_ = 0; y_ < size; y_++) {
-  //   for (int x_ = 0; x_ < size; x_++) {
+  // for (int y_ = 0; y_ < altitude->height; y_++) {
+  //   for (int x_ = 0; x_ < altitude->width; x_++) {
   //     if (x_ == x) {
   //       printf("%2d/%-2d", y_min_arr[y_], y_max_arr[y_]);
   //     } else if (y_ == y) {
@@ -150,19 +399,567 @@ int rectangle_size(int x, int y, int size, int altitude[][MAP_MAX]) {
       }
     }
   }
+  return area;
+}
 
+// largest rectangle containing row y within the row ranges lo[] and hi[] of
+// rows [y_min, y_max], which only shrink away from y
+int castle_in_bounds(const int *lo, const int *hi, int y_min, int y_max,
+                     int y) {
+  int area = 0;
+  for (int y1 = y; y1 >= y_min; y1--) {
+    // even the tallest rectangle with this top row can't do better
+    if ((y_max - y1 + 1) * (hi[y1] - lo[y1] + 1) <= area) {
+      continue;
+    }
+    for (int y2 = y; y2 <= y_max; y2++) {
+      int left = lo[y1] > lo[y2] ? lo[y1] : lo[y2];
+      int right = hi[y1] < hi[y2] ? hi[y1] : hi[y2];
+      int area_ = (y2 - y1 + 1) * (right - left + 1);
+      if (area_ > area) {
+        area = area_;
+      }
+    }
+  }
   return area;
 }
 
-void castleArea(int altitude[][MAP_MAX], int size, int area[][MAP_MAX]) {
-  for (int j = 0; j < size; j++) {
-    for (int i = 0; i < size; i++) {
-      area[i][j] = rectangle_size(i, j, size, altitude);
+// The castle of (x, y) if the cell had altitude `alt`, same search as
+// rectangle_size with a cheaper last step. The rows of the castle are limited
+// by the column through (x, y); for every row we take how far it reaches
+// along x, narrowed by make_convex so that the ranges only shrink away from y.
+// The widest rectangle over rows [y1, y2] then spans the intersection of the
+// two end ranges, so it's enough to go over the pairs of end rows.
+int castle_at(int x, int y, int alt, const Grid *altitude,
+              const ReachTable *reach, BoundScratch *scratch) {
+  int *lo = scratch->y_min_arr;
+  int *hi = scratch->y_max_arr;
+
+  int y_min = find_y_bound(x, y, -1, alt, altitude, reach);
+  int y_max = find_y_bound(x, y, 1, alt, altitude, reach);
+  for (int y_ = y_min; y_ <= y_max; y_++) {
+    lo[y_] = find_x_bound(x, y_, -1, alt, altitude, reach);
+    hi[y_] = find_x_bound(x, y_, 1, alt, altitude, reach);
+  }
+  make_convex(lo, hi, y_min, y_max, y);
+  return castle_in_bounds(lo, hi, y_min, y_max, y);
+}
+
+// Point queries: the castle of a single cell, possibly at an altitude it
+// doesn't have, without touching the rest of the map.
+//
+// Every row and every column gets a sparse table of range maxima, level k
+// holding the maximum of 2^k cells starting at each one. A bound is then found
+// by binary lifting, taking the longest power of two step whose maximum is
+// still lower than the altitude, in O(log n) instead of a walk over the cells
+// it passes. A full 2D table would answer rectangle maxima directly, but needs
+// O(n^2 log^2 n) memory. The rectangle itself still needs the range of every
+// row the column through the cell reaches, so a query costs
+// O(rows * log n) for the bounds plus the pairs of castle_in_bounds.
+
+typedef struct {
+  int width;
+  int height;
+  int x_levels;
+  int y_levels;
+  // along_x[k][y * width + x] is the maximum of (x .. x + 2^k - 1, y)
+  int **along_x;
+  // along_y[k][x * height + y] is the maximum of (x, y .. y + 2^k - 1)
+  int **along_y;
+} CastleIndex;
+
+typedef struct {
+  int x;
+  int y;
+  int altitude;
+} CastleQuery;
+
+int level_count(int n) {
+  int levels = 1;
+  while ((1 << levels) <= n) {
+    levels++;
+  }
+  return levels;
+}
+
+void castle_index_build(CastleIndex *index, const Grid *altitude) {
+  int width = altitude->width;
+  int height = altitude->height;
+  size_t cells = (size_t)width * height;
+  index->width = width;
+  index->height = height;
+  index->x_levels = level_count(width);
+  index->y_levels = level_count(height);
+  index->along_x = (int **)malloc(index->x_levels * sizeof(int *));
+  index->along_y = (int **)malloc(index->y_levels * sizeof(int *));
+
+  index->along_x[0] = (int *)malloc(cells * sizeof(int));
+  index->along_y[0] = (int *)malloc(cells * sizeof(int));
+  for (int x = 0; x < width; x++) {
+    grid_read_row(altitude, x, index->along_y[0] + (size_t)x * height);
+    for (int y = 0; y < height; y++) {
+      index->along_x[0][(size_t)y * width + x] =
+          index->along_y[0][(size_t)x * height + y];
+    }
+  }
+
+  for (int k = 1; k < index->x_levels; k++) {
+    const int *prev = index->along_x[k - 1];
+    int *level = (int *)malloc(cells * sizeof(int));
+    int step = 1 << (k - 1);
+    for (int y = 0; y < height; y++) {
+      size_t row = (size_t)y * width;
+      for (int x = 0; x + 2 * step <= width; x++) {
+        int a = prev[row + x];
+        int b = prev[row + x + step];
+        level[row + x] = a > b ? a : b;
+      }
+    }
+    index->along_x[k] = level;
+  }
+  for (int k = 1; k < index->y_levels; k++) {
+    const int *prev = index->along_y[k - 1];
+    int *level = (int *)malloc(cells * sizeof(int));
+    int step = 1 << (k - 1);
+    for (int x = 0; x < width; x++) {
+      size_t column = (size_t)x * height;
+      for (int y = 0; y + 2 * step <= height; y++) {
+        int a = prev[column + y];
+        int b = prev[column + y + step];
+        level[column + y] = a > b ? a : b;
+      }
+    }
+    index->along_y[k] = level;
+  }
+}
+
+void castle_index_free(CastleIndex *index) {
+  for (int k = 0; k < index->x_levels; k++) {
+    free(index->along_x[k]);
+  }
+  for (int k = 0; k < index->y_levels; k++) {
+    free(index->along_y[k]);
+  }
+  free(index->along_x);
+  free(index->along_y);
+}
+
+size_t castle_index_footprint(const CastleIndex *index) {
+  size_t cells = (size_t)index->width * index->height;
+  return sizeof(CastleIndex) + (index->x_levels + index->y_levels) *
+                                   (sizeof(int *) + cells * sizeof(int));
+}
+
+// Bound of the cells lower than `alt` going from `from` along a line of
+// `length` cells, `line` being the first cell of the line in every level of
+// the table. Same as find_x_bound, the starting cell isn't checked.
+int index_bound(int *const *levels, int level_count, size_t line, int length,
+                int from, int dir, int alt) {
+  int pos = from;
+  for (int k = level_count - 1; k >= 0; k--) {
+    int step = 1 << k;
+    if (dir > 0) {
+      if (pos + step < length &&
+          levels[k][line + pos + 1] < alt) {
+        pos += step;
+      }
+    } else {
+      if (pos - step >= 0 && levels[k][line + pos - step] < alt) {
+        pos -= step;
+      }
+    }
+  }
+  return pos;
+}
+
+// the castle containing (x, y) in which all the other cells are lower than
+// `alt`, the altitude of (x, y) itself doesn't matter
+int castle_query(const CastleIndex *index, int x, int y, int alt,
+                 BoundScratch *scratch) {
+  int *lo = scratch->y_min_arr;
+  int *hi = scratch->y_max_arr;
+  size_t column = (size_t)x * index->height;
+
+  int y_min = index_bound(index->along_y, index->y_levels, column,
+                          index->height, y, -1, alt);
+  int y_max = index_bound(index->along_y, index->y_levels, column,
+                          index->height, y, 1, alt);
+  for (int y_ = y_min; y_ <= y_max; y_++) {
+    size_t row = (size_t)y_ * index->width;
+    lo[y_] = index_bound(index->along_x, index->x_levels, row, index->width,
+                         x, -1, alt);
+    hi[y_] = index_bound(index->along_x, index->x_levels, row, index->width,
+                         x, 1, alt);
+  }
+  make_convex(lo, hi, y_min, y_max, y);
+  return castle_in_bounds(lo, hi, y_min, y_max, y);
+}
+
+// castle_query for every query, areas[i] answering queries[i]
+void castle_query_batch(const CastleIndex *index, const CastleQuery *queries,
+                        int count, int *areas) {
+  BoundScratch scratch = {};
+  scratch.y_min_arr = (int *)malloc(index->height * sizeof(int));
+  scratch.y_max_arr = (int *)malloc(index->height * sizeof(int));
+  for (int i = 0; i < count; i++) {
+    areas[i] = castle_query(index, queries[i].x, queries[i].y,
+                            queries[i].altitude, &scratch);
+  }
+  free(scratch.y_min_arr);
+  free(scratch.y_max_arr);
+}
+
+// the castle of every cell, searched for around each cell separately, with
+// the bounds taken from a ReachTable unless `reach` is NULL
+void castle_area_cells(const Grid *altitude, Grid *area,
+                       const ReachTable *reach) {
+  BoundScratch scratch = {};
+  scratch_init(&scratch, altitude);
+  for (int y = 0; y < altitude->height; y++) {
+    for (int x = 0; x < altitude->width; x++) {
+      grid_set(area, x, y, rectangle_size(x, y, altitude, reach, &scratch));
+    }
+  }
+  scratch_free(&scratch);
+}
+
+// Every castle is a rectangle in which its cell is the unique highest one, so
+// instead of growing a rectangle around each cell, we go over the row spans
+// [top, bottom] of all rectangles. For a fixed span, every column collapses to
+// its highest cell. The widest rectangle of that span in which column y holds
+// the unique maximum reaches from the previous column that is at least as high
+// to the next one, a monotonic stack finds these for all columns in one pass.
+// The rectangle is a candidate for the highest cell of column y, as long as
+// that cell is unique in its column. O(width^2 * height) no matter the terrain.
+
+// per column state of the sweep, one per thread
+typedef struct {
+  int *row;
+  int *column_max;
+  int *column_arg;
+  bool *column_unique;
+  int *left;
+  int *stack;
+} SweepScratch;
+
+void sweep_scratch_init(SweepScratch *scratch, int height) {
+  scratch->row = (int *)malloc(height * sizeof(int));
+  scratch->column_max = (int *)malloc(height * sizeof(int));
+  scratch->column_arg = (int *)malloc(height * sizeof(int));
+  scratch->column_unique = (bool *)malloc(height * sizeof(bool));
+  scratch->left = (int *)malloc(height * sizeof(int));
+  scratch->stack = (int *)malloc(height * sizeof(int));
+}
+
+void sweep_scratch_free(SweepScratch *scratch) {
+  free(scratch->row);
+  free(scratch->column_max);
+  free(scratch->column_arg);
+  free(scratch->column_unique);
+  free(scratch->left);
+  free(scratch->stack);
+}
+
+void atomic_max(int *cell, int value) {
+  int current = __atomic_load_n(cell, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(cell, &current, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// the stages of one span [top, bottom], split up so that the benchmark can
+// time passes that stop after each of them
+
+// folds row `bottom` into the highest cell of every column
+void sweep_fold_row(const Grid *altitude, int bottom, SweepScratch *scratch) {
+  int *row = scratch->row;
+  int *column_max = scratch->column_max;
+  int *column_arg = scratch->column_arg;
+  bool *column_unique = scratch->column_unique;
+  grid_read_row(altitude, bottom, row);
+  for (int y = 0; y < altitude->height; y++) {
+    int alt = row[y];
+    if (alt > column_max[y]) {
+      column_max[y] = alt;
+      column_arg[y] = bottom;
+      column_unique[y] = true;
+    } else if (alt == column_max[y]) {
+      column_unique[y] = false;
+    }
+  }
+}
+
+// left[y] is the closest column to the left which is at least as high
+void sweep_left(int height, SweepScratch *scratch) {
+  const int *column_max = scratch->column_max;
+  int *left = scratch->left;
+  int *stack = scratch->stack;
+  int depth = 0;
+  for (int y = 0; y < height; y++) {
+    while (depth > 0 && column_max[stack[depth - 1]] < column_max[y]) {
+      depth--;
+    }
+    left[y] = depth > 0 ? stack[depth - 1] : -1;
+    stack[depth++] = y;
+  }
+}
+
+// the closest column to the right which is at least as high, and with it the
+// candidate of every column whose highest cell is unique
+void sweep_right(int height, int span, SweepScratch *scratch, int *cells,
+                 bool shared) {
+  const int *column_max = scratch->column_max;
+  const int *column_arg = scratch->column_arg;
+  const bool *column_unique = scratch->column_unique;
+  const int *left = scratch->left;
+  int *stack = scratch->stack;
+  int depth = 0;
+  for (int y = height - 1; y >= 0; y--) {
+    while (depth > 0 && column_max[stack[depth - 1]] < column_max[y]) {
+      depth--;
+    }
+    int right = depth > 0 ? stack[depth - 1] : height;
+    stack[depth++] = y;
+
+    if (column_unique[y]) {
+      int candidate = span * (right - left[y] - 1);
+      int *cell = &cells[(size_t)column_arg[y] * height + y];
+      if (shared) {
+        atomic_max(cell, candidate);
+      } else if (candidate > *cell) {
+        *cell = candidate;
+      }
+    }
+  }
+}
+
+void sweep_reset(int height, SweepScratch *scratch) {
+  for (int y = 0; y < height; y++) {
+    scratch->column_max[y] = INT_MIN;
+  }
+}
+
+// all spans starting at row `top`, `shared` when other threads write into
+// `cells` at the same time
+void sweep_from_top(const Grid *altitude, int top, SweepScratch *scratch,
+                    int *cells, bool shared) {
+  int height = altitude->height;
+  sweep_reset(height, scratch);
+  for (int bottom = top; bottom < altitude->width; bottom++) {
+    sweep_fold_row(altitude, bottom, scratch);
+    sweep_left(height, scratch);
+    sweep_right(height, bottom - top + 1, scratch, cells, shared);
+  }
+}
+
+// `area` must have 4 byte cells.
+void castle_area_sweep(const Grid *altitude, Grid *area) {
+  assert(area->width == altitude->width && area->height == altitude->height);
+  assert(area->cell_bytes == 4);
+
+  int *cells = (int *)area->cells;
+  memset(cells, 0, (size_t)altitude->width * altitude->height * sizeof(int));
+
+  SweepScratch scratch = {};
+  sweep_scratch_init(&scratch, altitude->height);
+  for (int top = 0; top < altitude->width; top++) {
+    sweep_from_top(altitude, top, &scratch, cells, false);
+  }
+  sweep_scratch_free(&scratch);
+}
+
+// Incremental update after a few altitude edits.
+//
+// The castle of a cell lies within the reach of find_x_bound and find_y_bound
+// from that cell, the rectangle must contain both the row and the column
+// through it. That reach only depends on the cells up to and including the
+// first higher one in each direction, so an edit can only change the castle
+// of a cell if it lies in the bounding box of the reach grown by one cell on
+// every side. Only those cells (and the edited ones) are recomputed.
+
+typedef struct {
+  int x;
+  int y;
+  int altitude;
+} AltitudeEdit;
+
+// switch a grid to 4 byte cells
+void grid_widen(Grid *grid) {
+  if (grid->cell_bytes == 4) {
+    return;
+  }
+  Grid wide = {};
+  grid_init(&wide, grid->width, grid->height, 4);
+  for (int x = 0; x < grid->width; x++) {
+    for (int y = 0; y < grid->height; y++) {
+      grid_set(&wide, x, y, grid_get(grid, x, y));
     }
   }
+  grid_free(grid);
+  *grid = wide;
+}
+
+// Applies the edits to `altitude` and updates `area` to match, returns the
+// number of cells that were recomputed.
+int castle_area_update(Grid *altitude, Grid *area, const AltitudeEdit *edits,
+                       int edit_count) {
+  int width = altitude->width;
+  int height = altitude->height;
+  ReachTable reach = {};
+  reach_init(&reach, width, height);
+  reach_build(&reach, altitude);
+
+  // edits[] as a 2D prefix count, so the edits within any box are O(1)
+  int stride = height + 1;
+  int *edited = (int *)calloc((size_t)(width + 1) * stride, sizeof(int));
+  for (int i = 0; i < edit_count; i++) {
+    assert(edits[i].x >= 0 && edits[i].x < width);
+    assert(edits[i].y >= 0 && edits[i].y < height);
+    edited[(size_t)(edits[i].x + 1) * stride + edits[i].y + 1] = 1;
+  }
+  for (int x = 1; x <= width; x++) {
+    for (int y = 1; y <= height; y++) {
+      edited[(size_t)x * stride + y] += edited[(size_t)(x - 1) * stride + y] +
+                                        edited[(size_t)x * stride + y - 1] -
+                                        edited[(size_t)(x - 1) * stride + y - 1];
+    }
+  }
+
+  // mark the affected cells under the old altitudes
+  bool *affected = (bool *)calloc((size_t)width * height, sizeof(bool));
+  for (int x = 0; x < width; x++) {
+    for (int y = 0; y < height; y++) {
+      int alt = grid_get(altitude, x, y);
+      int x_min = find_x_bound(x, y, -1, alt, altitude, &reach) - 1;
+      int x_max = find_x_bound(x, y, 1, alt, altitude, &reach) + 1;
+      int y_min = find_y_bound(x, y, -1, alt, altitude, &reach) - 1;
+      int y_max = find_y_bound(x, y, 1, alt, altitude, &reach) + 1;
+      x_min = x_min < 0 ? 0 : x_min;
+      y_min = y_min < 0 ? 0 : y_min;
+      x_max = x_max >= width ? width - 1 : x_max;
+      y_max = y_max >= height ? height - 1 : y_max;
+
+      int inside = edited[(size_t)(x_max + 1) * stride + y_max + 1] -
+                   edited[(size_t)x_min * stride + y_max + 1] -
+                   edited[(size_t)(x_max + 1) * stride + y_min] +
+                   edited[(size_t)x_min * stride + y_min];
+      affected[(size_t)x * height + y] = inside > 0;
+    }
+  }
+
+  for (int i = 0; i < edit_count; i++) {
+    if (cell_bytes_for(edits[i].altitude, edits[i].altitude) >
+        altitude->cell_bytes) {
+      grid_widen(altitude);
+    }
+    grid_set(altitude, edits[i].x, edits[i].y, edits[i].altitude);
+  }
+  reach_build(&reach, altitude);
+
+  int recomputed = 0;
+  BoundScratch scratch = {};
+  scratch_init(&scratch, altitude);
+  for (int x = 0; x < width; x++) {
+    for (int y = 0; y < height; y++) {
+      if (affected[(size_t)x * height + y]) {
+        int alt = grid_get(altitude, x, y);
+        grid_set(area, x, y,
+                 castle_at(x, y, alt, altitude, &reach, &scratch));
+        recomputed++;
+      }
+    }
+  }
+  scratch_free(&scratch);
+  reach_free(&reach);
+
+  free(affected);
+  free(edited);
+  return recomputed;
+}
+
+void castleArea(int altitude[][MAP_MAX], int size, int area[][MAP_MAX]) {
+  Grid altitude_grid = {};
+  Grid area_grid = {};
+  grid_from_map(&altitude_grid, altitude, size);
+  grid_init(&area_grid, size, size, 4);
+  castle_area_sweep(&altitude_grid, &area_grid);
+  grid_to_map(&area_grid, area);
+  grid_free(&altitude_grid);
+  grid_free(&area_grid);
 }
 
 #ifndef __PROGTEST__
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The parallel sweep hands out bands of top rows. Spans starting higher up
+// are longer, so the bands are claimed from a shared counter in order instead
+// of being split up front, and they are small enough for the threads to even
+// out at the end. Threads merge their candidates into the area grid with an
+// atomic max. Only the benchmark uses it, castleArea stays on one thread.
+typedef struct {
+  const Grid *altitude;
+  int *cells;
+  int band;
+  int next_top;
+} SweepJob;
+
+void *sweep_worker(void *arg) {
+  SweepJob *job = (SweepJob *)arg;
+  SweepScratch scratch = {};
+  sweep_scratch_init(&scratch, job->altitude->height);
+  while (true) {
+    int top = __atomic_fetch_add(&job->next_top, job->band, __ATOMIC_RELAXED);
+    if (top >= job->altitude->width) {
+      break;
+    }
+    int end = top + job->band;
+    if (end > job->altitude->width) {
+      end = job->altitude->width;
+    }
+    for (; top < end; top++) {
+      sweep_from_top(job->altitude, top, &scratch, job->cells, true);
+    }
+  }
+  sweep_scratch_free(&scratch);
+  return NULL;
+}
+
+void castle_area_parallel(const Grid *altitude, Grid *area, int threads) {
+  assert(area->width == altitude->width && area->height == altitude->height);
+  assert(area->cell_bytes == 4);
+  assert(threads >= 1);
+
+  SweepJob job = {};
+  job.altitude = altitude;
+  job.cells = (int *)area->cells;
+  job.band = altitude->width / (threads * 16);
+  if (job.band < 1) {
+    job.band = 1;
+  }
+  job.next_top = 0;
+  memset(job.cells, 0, (size_t)altitude->width * altitude->height * sizeof(int));
+
+  pthread_t *handles = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  // the calling thread is one of the workers, it also takes over the bands
+  // of any thread that could not be started
+  int started = 0;
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&handles[started], NULL, sweep_worker, &job) == 0) {
+      started++;
+    }
+  }
+  sweep_worker(&job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(handles[i], NULL);
+  }
+  free(handles);
+}
+
 bool identicalMap(const int a[][MAP_MAX], const int b[][MAP_MAX], int size) {
   for (int j = 0; j < size; j++) {
     for (int i = 0; i < size; i++) {
@@ -212,7 +1009,691 @@ void compare_area(int input[][MAP_MAX], int output[][MAP_MAX],
   }
 }
 
+void random_map(int altitude[][MAP_MAX], int size, int max_altitude,
+                unsigned *seed) {
+  for (int i = 0; i < size; i++) {
+    for (int j = 0; j < size; j++) {
+      *seed = *seed * 1103515245 + 12345;
+      altitude[i][j] = (*seed >> 16) % (max_altitude + 1);
+    }
+  }
+}
+
+void random_grid(Grid *altitude, int max_altitude, unsigned *seed) {
+  for (int x = 0; x < altitude->width; x++) {
+    for (int y = 0; y < altitude->height; y++) {
+      *seed = *seed * 1103515245 + 12345;
+      grid_set(altitude, x, y, (*seed >> 16) % (max_altitude + 1));
+    }
+  }
+}
+
+bool identical_grid(const Grid *a, const Grid *b) {
+  if (a->width != b->width || a->height != b->height) {
+    return false;
+  }
+  for (int x = 0; x < a->width; x++) {
+    for (int y = 0; y < a->height; y++) {
+      if (grid_get(a, x, y) != grid_get(b, x, y)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// castleArea against the per-cell search on random maps, small altitude
+// ranges produce plenty of equal neighbours
+void compare_engines() {
+  static int alt[MAP_MAX][MAP_MAX];
+  static int expected[MAP_MAX][MAP_MAX];
+  static int result[MAP_MAX][MAP_MAX];
+  const int sizes[] = {1, 2, 3, 7, 16, 31, 60};
+  const int max_altitudes[] = {1, 3, 10, 1000};
+  unsigned seed = 42;
+  for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+    for (int a = 0; a < (int)(sizeof(max_altitudes) / sizeof(int)); a++) {
+      random_map(alt, sizes[s], max_altitudes[a], &seed);
+
+      Grid altitude = {};
+      Grid area = {};
+      grid_from_map(&altitude, alt, sizes[s]);
+      grid_init(&area, sizes[s], sizes[s], 4);
+      castle_area_cells(&altitude, &area, NULL);
+      grid_to_map(&area, expected);
+
+      // the same engine with its bounds from a ReachTable
+      ReachTable reach = {};
+      reach_init(&reach, sizes[s], sizes[s]);
+      reach_build(&reach, &altitude);
+      castle_area_cells(&altitude, &area, &reach);
+      grid_to_map(&area, result);
+      compare_area(alt, result, expected, sizes[s]);
+      reach_free(&reach);
+      grid_free(&altitude);
+      grid_free(&area);
+
+      castleArea(alt, sizes[s], result);
+      compare_area(alt, result, expected, sizes[s]);
+    }
+  }
+
+  // maps that are not square or bigger than MAP_MAX
+  const int dims[][2] = {{1, 50}, {50, 1}, {37, 211}, {260, 90}};
+  for (int d = 0; d < (int)(sizeof(dims) / sizeof(dims[0])); d++) {
+    Grid altitude = {};
+    Grid expected_area = {};
+    Grid area = {};
+    grid_init(&altitude, dims[d][0], dims[d][1], 2);
+    grid_init(&expected_area, dims[d][0], dims[d][1], 4);
+    grid_init(&area, dims[d][0], dims[d][1], 4);
+    random_grid(&altitude, 20, &seed);
+    castle_area_cells(&altitude, &expected_area, NULL);
+    castle_area_sweep(&altitude, &area);
+    if (!identical_grid(&area, &expected_area)) {
+      printf("Mismatch on a %dx%d map\n", dims[d][0], dims[d][1]);
+    }
+    grid_free(&altitude);
+    grid_free(&expected_area);
+    grid_free(&area);
+  }
+
+  // incremental updates against a full recomputation, including edits that
+  // no longer fit into 16 bits
+  for (int round = 0; round < 20; round++) {
+    Grid altitude = {};
+    Grid expected_area = {};
+    Grid area = {};
+    grid_init(&altitude, 40, 33, 2);
+    grid_init(&expected_area, 40, 33, 4);
+    grid_init(&area, 40, 33, 4);
+    random_grid(&altitude, round % 2 ? 5 : 500, &seed);
+    castle_area_sweep(&altitude, &area);
+
+    AltitudeEdit edits[8];
+    int edit_count = 1 + round % 8;
+    for (int i = 0; i < edit_count; i++) {
+      seed = seed * 1103515245 + 12345;
+      edits[i].x = (seed >> 16) % altitude.width;
+      seed = seed * 1103515245 + 12345;
+      edits[i].y = (seed >> 16) % altitude.height;
+      seed = seed * 1103515245 + 12345;
+      edits[i].altitude = round == 19 ? 100000 : (seed >> 16) % 600;
+    }
+    castle_area_update(&altitude, &area, edits, edit_count);
+    castle_area_sweep(&altitude, &expected_area);
+    if (!identical_grid(&area, &expected_area)) {
+      printf("Mismatch after %d edits\n", edit_count);
+    }
+    grid_free(&altitude);
+    grid_free(&expected_area);
+    grid_free(&area);
+  }
+
+  // point queries at the altitude of each cell against the sweep, and at
+  // made up altitudes against castle_at
+  for (int round = 0; round < 6; round++) {
+    int width = 1 + round * 9;
+    int height = 31 - round * 4;
+    int max_altitude = round % 2 ? 4 : 300;
+    Grid altitude = {};
+    Grid area = {};
+    grid_init(&altitude, width, height, 2);
+    grid_init(&area, width, height, 4);
+    random_grid(&altitude, max_altitude, &seed);
+    castle_area_sweep(&altitude, &area);
+
+    CastleIndex index = {};
+    castle_index_build(&index, &altitude);
+    BoundScratch scratch = {};
+    scratch_init(&scratch, &altitude);
+    for (int x = 0; x < width; x++) {
+      for (int y = 0; y < height; y++) {
+        int own = castle_query(&index, x, y, grid_get(&altitude, x, y),
+                               &scratch);
+        seed = seed * 1103515245 + 12345;
+        int alt = (seed >> 16) % (max_altitude + 2);
+        int made_up = castle_query(&index, x, y, alt, &scratch);
+        if (own != grid_get(&area, x, y) ||
+            made_up != castle_at(x, y, alt, &altitude, NULL, &scratch)) {
+          printf("Query mismatch at %d, %d on a %dx%d map\n", x, y, width,
+                 height);
+        }
+      }
+    }
+    scratch_free(&scratch);
+    castle_index_free(&index);
+    grid_free(&altitude);
+    grid_free(&area);
+  }
+}
+
+// castles of a random width x height map, with the memory the grids take
+// compared to a pair of fixed MAP_MAX x MAP_MAX arrays
+void report_footprint(int width, int height, int max_altitude) {
+  Grid altitude = {};
+  Grid area = {};
+  grid_init(&altitude, width, height, cell_bytes_for(0, max_altitude));
+  grid_init(&area, width, height, 4);
+  unsigned seed = 7;
+  random_grid(&altitude, max_altitude, &seed);
+
+  double start = now_seconds();
+  castle_area_sweep(&altitude, &area);
+  double seconds = now_seconds() - start;
+
+  size_t fixed = 2 * sizeof(int[MAP_MAX][MAP_MAX]);
+  printf("%dx%d map, %d byte altitudes\n", width, height, altitude.cell_bytes);
+  printf("  altitude %zu B, area %zu B, total %zu B\n",
+         grid_footprint(&altitude), grid_footprint(&area),
+         grid_footprint(&altitude) + grid_footprint(&area));
+  printf("  fixed %dx%d arrays %zu B%s\n", MAP_MAX, MAP_MAX, fixed,
+         width > MAP_MAX || height > MAP_MAX ? " (too small)" : "");
+  printf("  castle_area_sweep %.3f s\n", seconds);
+
+  grid_free(&altitude);
+  grid_free(&area);
+}
+
+// parallel sweep on 1 to all cores against the serial one
+void report_scaling(int size, int max_altitude) {
+  Grid altitude = {};
+  Grid serial = {};
+  Grid parallel = {};
+  grid_init(&altitude, size, size, cell_bytes_for(0, max_altitude));
+  grid_init(&serial, size, size, 4);
+  grid_init(&parallel, size, size, 4);
+  unsigned seed = 7;
+  random_grid(&altitude, max_altitude, &seed);
+
+  double start = now_seconds();
+  castle_area_sweep(&altitude, &serial);
+  double serial_seconds = now_seconds() - start;
+  printf("%dx%d map\n", size, size);
+  printf("  %-8s %9.3f s\n", "serial", serial_seconds);
+
+  static int expected[MAP_MAX][MAP_MAX];
+  static int result[MAP_MAX][MAP_MAX];
+  if (size <= MAP_MAX) {
+    grid_to_map(&serial, expected);
+  }
+
+  // sysconf returns -1 when the count is not known
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    cores = 1;
+  }
+  for (int threads = 1;; threads *= 2) {
+    if (threads > cores) {
+      threads = cores;
+    }
+    start = now_seconds();
+    castle_area_parallel(&altitude, &parallel, threads);
+    double seconds = now_seconds() - start;
+
+    bool same = false;
+    if (size <= MAP_MAX) {
+      grid_to_map(&parallel, result);
+      same = identicalMap(result, expected, size);
+    } else {
+      same = identical_grid(&parallel, &serial);
+    }
+    printf("  %2d %-5s %9.3f s  %5.2fx  %s\n", threads,
+           threads == 1 ? "thread" : "threads", seconds,
+           serial_seconds / seconds, same ? "ok" : "MISMATCH");
+    if (threads >= cores) {
+      break;
+    }
+  }
+
+  grid_free(&altitude);
+  grid_free(&serial);
+  grid_free(&parallel);
+}
+
+// incremental updates after 1, 10 and 1000 random edits against recomputing
+// the whole map with the sweep
+void report_incremental(int size, int max_altitude) {
+  const int edit_counts[] = {1, 10, 1000};
+  Grid altitude = {};
+  Grid area = {};
+  Grid expected = {};
+  grid_init(&altitude, size, size, cell_bytes_for(0, max_altitude));
+  grid_init(&area, size, size, 4);
+  grid_init(&expected, size, size, 4);
+  unsigned seed = 11;
+  random_grid(&altitude, max_altitude, &seed);
+  castle_area_sweep(&altitude, &area);
+
+  printf("%dx%d map\n", size, size);
+  printf("  %6s %12s %12s %10s %8s\n", "edits", "recomputed", "update",
+         "full", "speedup");
+  for (int e = 0; e < (int)(sizeof(edit_counts) / sizeof(int)); e++) {
+    int edit_count = edit_counts[e];
+    AltitudeEdit *edits =
+        (AltitudeEdit *)malloc(edit_count * sizeof(AltitudeEdit));
+    for (int i = 0; i < edit_count; i++) {
+      seed = seed * 1103515245 + 12345;
+      edits[i].x = (seed >> 8) % size;
+      seed = seed * 1103515245 + 12345;
+      edits[i].y = (seed >> 8) % size;
+      seed = seed * 1103515245 + 12345;
+      edits[i].altitude = (seed >> 8) % (max_altitude + 1);
+    }
+
+    double start = now_seconds();
+    int recomputed = castle_area_update(&altitude, &area, edits, edit_count);
+    double update_seconds = now_seconds() - start;
+
+    start = now_seconds();
+    castle_area_sweep(&altitude, &expected);
+    double full_seconds = now_seconds() - start;
+
+    printf("  %6d %12d %10.4f s %8.4f s %7.1fx %s\n", edit_count, recomputed,
+           update_seconds, full_seconds, full_seconds / update_seconds,
+           identical_grid(&area, &expected) ? "" : "MISMATCH");
+    free(edits);
+  }
+
+  grid_free(&altitude);
+  grid_free(&area);
+  grid_free(&expected);
+}
+
+// the per cell engine walking the bounds cell by cell against looking them up
+// in a ReachTable, each timed as a whole pass over the map
+void report_reach(int size, int max_altitude) {
+  Grid altitude = {};
+  Grid walked = {};
+  Grid reached = {};
+  grid_init(&altitude, size, size, cell_bytes_for(0, max_altitude));
+  grid_init(&walked, size, size, 4);
+  grid_init(&reached, size, size, 4);
+  unsigned seed = 7;
+  random_grid(&altitude, max_altitude, &seed);
+
+  printf("%dx%d map\n", size, size);
+  double start = now_seconds();
+  castle_area_cells(&altitude, &walked, NULL);
+  printf("  walks        %8.4f s\n", now_seconds() - start);
+
+  start = now_seconds();
+  ReachTable reach = {};
+  reach_init(&reach, size, size);
+  reach_build(&reach, &altitude);
+  double reach_seconds = now_seconds() - start;
+  start = now_seconds();
+  castle_area_cells(&altitude, &reached, &reach);
+  double cells_seconds = now_seconds() - start;
+  printf("  reach table  %8.4f s, %8.4f s to build, %zu B %s\n",
+         cells_seconds, reach_seconds, reach_footprint(&reach),
+         identical_grid(&walked, &reached) ? "" : "MISMATCH");
+
+  reach_free(&reach);
+  grid_free(&altitude);
+  grid_free(&walked);
+  grid_free(&reached);
+}
+
+// random point queries through a CastleIndex against rectangle_size for
+// each cell on its own
+void report_query(int size, int max_altitude, int count) {
+  Grid altitude = {};
+  grid_init(&altitude, size, size, cell_bytes_for(0, max_altitude));
+  unsigned seed = 7;
+  random_grid(&altitude, max_altitude, &seed);
+
+  CastleQuery *queries = (CastleQuery *)calloc(count, sizeof(CastleQuery));
+  int *areas = (int *)calloc(count, sizeof(int));
+  for (int i = 0; i < count; i++) {
+    seed = seed * 1103515245 + 12345;
+    queries[i].x = (seed >> 8) % size;
+    seed = seed * 1103515245 + 12345;
+    queries[i].y = (seed >> 8) % size;
+    queries[i].altitude = grid_get(&altitude, queries[i].x, queries[i].y);
+  }
+
+  double start = now_seconds();
+  CastleIndex index = {};
+  castle_index_build(&index, &altitude);
+  double build_seconds = now_seconds() - start;
+
+  start = now_seconds();
+  castle_query_batch(&index, queries, count, areas);
+  double query_seconds = now_seconds() - start;
+
+  BoundScratch scratch = {};
+  scratch_init(&scratch, &altitude);
+  bool same = true;
+  start = now_seconds();
+  for (int i = 0; i < count; i++) {
+    int area = rectangle_size(queries[i].x, queries[i].y, &altitude, NULL,
+                              &scratch);
+    same = same && area == areas[i];
+  }
+  double cells_seconds = now_seconds() - start;
+
+  // the same sites, 100 higher than they are, which only castle_at can do
+  // without the index
+  for (int i = 0; i < count; i++) {
+    queries[i].altitude += 100;
+  }
+  start = now_seconds();
+  castle_query_batch(&index, queries, count, areas);
+  double raised_seconds = now_seconds() - start;
+  bool raised_same = true;
+  start = now_seconds();
+  for (int i = 0; i < count; i++) {
+    int area = castle_at(queries[i].x, queries[i].y, queries[i].altitude,
+                         &altitude, NULL, &scratch);
+    raised_same = raised_same && area == areas[i];
+  }
+  double walks_seconds = now_seconds() - start;
+  scratch_free(&scratch);
+
+  printf("%dx%d map, %d queries\n", size, size, count);
+  printf("  index build     %9.4f s, %zu B\n", build_seconds,
+         castle_index_footprint(&index));
+  printf("  castle_query    %9.1f us/query\n", query_seconds * 1e6 / count);
+  printf("  rectangle_size  %9.1f us/query  %s\n", cells_seconds * 1e6 / count,
+         same ? "" : "MISMATCH");
+  printf("  raised by 100\n");
+  printf("  castle_query    %9.1f us/query\n", raised_seconds * 1e6 / count);
+  printf("  castle_at       %9.1f us/query  %s\n", walks_seconds * 1e6 / count,
+         raised_same ? "" : "MISMATCH");
+
+  castle_index_free(&index);
+  free(queries);
+  free(areas);
+  grid_free(&altitude);
+}
+
+// time stamp counter, 0 where there is none
+uint64_t cycles_now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+typedef enum {
+  TERRAIN_RANDOM,
+  // rising with x + y
+  TERRAIN_RAMP,
+  // a single cone in the middle
+  TERRAIN_PEAK,
+  // 16x16 blocks of equal altitude
+  TERRAIN_PLATEAUS,
+  // alternating 0 and 1
+  TERRAIN_CHECKERBOARD,
+  TERRAIN_COUNT
+} Terrain;
+
+const char *terrain_names[TERRAIN_COUNT] = {"random", "ramp", "peak",
+                                            "plateaus", "checkerboard"};
+
+void generate_terrain(Grid *altitude, Terrain terrain, unsigned *seed) {
+  int center_x = altitude->width / 2;
+  int center_y = altitude->height / 2;
+  int blocks_y = (altitude->height + 15) / 16;
+  int block_count = (altitude->width + 15) / 16 * blocks_y;
+  int *block = (int *)malloc(block_count * sizeof(int));
+  for (int b = 0; b < block_count; b++) {
+    *seed = *seed * 1103515245 + 12345;
+    block[b] = (*seed >> 16) % 10;
+  }
+
+  for (int x = 0; x < altitude->width; x++) {
+    for (int y = 0; y < altitude->height; y++) {
+      int alt = 0;
+      switch (terrain) {
+      case TERRAIN_RANDOM:
+        *seed = *seed * 1103515245 + 12345;
+        alt = (*seed >> 16) % 1001;
+        break;
+      case TERRAIN_RAMP:
+        alt = x + y;
+        break;
+      case TERRAIN_PEAK:
+        alt = altitude->width + altitude->height - abs(x - center_x) -
+              abs(y - center_y);
+        break;
+      case TERRAIN_PLATEAUS:
+        alt = block[(x / 16) * blocks_y + y / 16];
+        break;
+      default:
+        alt = (x + y) % 2;
+        break;
+      }
+      grid_set(altitude, x, y, alt);
+    }
+  }
+  free(block);
+}
+
+// keeps the passes of sweep_pass_seconds from being optimized away
+volatile unsigned sweep_sink;
+
+// One pass of the sweep over the whole map that stops after the first
+// `stages` of its three stages for every span. Timing whole passes keeps the
+// clock out of the inner loops, the differences between the passes are what
+// each stage costs.
+double sweep_pass_seconds(const Grid *altitude, int *cells, int stages) {
+  int width = altitude->width;
+  int height = altitude->height;
+  SweepScratch scratch = {};
+  sweep_scratch_init(&scratch, height);
+  memset(cells, 0, (size_t)width * height * sizeof(int));
+
+  double start = now_seconds();
+  for (int top = 0; top < width; top++) {
+    sweep_reset(height, &scratch);
+    for (int bottom = top; bottom < width; bottom++) {
+      sweep_fold_row(altitude, bottom, &scratch);
+      if (stages > 1) {
+        sweep_left(height, &scratch);
+      }
+      if (stages > 2) {
+        sweep_right(height, bottom - top + 1, &scratch, cells, false);
+      }
+    }
+    sweep_sink = sweep_sink + (unsigned)scratch.column_max[0];
+  }
+  double seconds = now_seconds() - start;
+  sweep_scratch_free(&scratch);
+  return seconds;
+}
+
+typedef struct {
+  Terrain terrain;
+  int size;
+  int sweep_runs;
+  double sweep_seconds;
+  double sweep_cycles;
+  // whole passes of the sweep, stage by stage
+  double fold_seconds;
+  double left_seconds;
+  double right_seconds;
+  // per cell engine with a ReachTable, only below the profile size
+  bool profiled;
+  double reach_seconds;
+  double cells_seconds;
+  bool same;
+} BenchResult;
+
+// Sweep (the engine behind castleArea) on one terrain, repeated until it took
+// at least 0.2 s, then split into its stages. For small enough maps also
+// castle_area_cells with a ReachTable, to check the sweep against.
+BenchResult bench_terrain(Terrain terrain, int size, int profile_size) {
+  BenchResult result = {};
+  result.terrain = terrain;
+  result.size = size;
+  Grid altitude = {};
+  Grid area = {};
+  grid_init(&altitude, size, size, 2);
+  grid_init(&area, size, size, 4);
+  unsigned seed = 7;
+  generate_terrain(&altitude, terrain, &seed);
+
+  double start = now_seconds();
+  uint64_t cycles = cycles_now();
+  do {
+    castle_area_sweep(&altitude, &area);
+    result.sweep_runs++;
+  } while (now_seconds() - start < 0.2);
+  result.sweep_cycles = (double)(cycles_now() - cycles) / result.sweep_runs;
+  result.sweep_seconds = (now_seconds() - start) / result.sweep_runs;
+
+  Grid staged = {};
+  grid_init(&staged, size, size, 4);
+  int *cells = (int *)staged.cells;
+  double fold = sweep_pass_seconds(&altitude, cells, 1);
+  double left = sweep_pass_seconds(&altitude, cells, 2);
+  double right = sweep_pass_seconds(&altitude, cells, 3);
+  result.fold_seconds = fold;
+  result.left_seconds = left > fold ? left - fold : 0;
+  result.right_seconds = right > left ? right - left : 0;
+  result.same = identical_grid(&staged, &area);
+
+  if (size <= profile_size) {
+    result.profiled = true;
+    start = now_seconds();
+    ReachTable reach = {};
+    reach_init(&reach, size, size);
+    reach_build(&reach, &altitude);
+    result.reach_seconds = now_seconds() - start;
+
+    start = now_seconds();
+    castle_area_cells(&altitude, &staged, &reach);
+    result.cells_seconds = now_seconds() - start;
+    result.same = result.same && identical_grid(&staged, &area);
+    reach_free(&reach);
+  }
+
+  grid_free(&altitude);
+  grid_free(&area);
+  grid_free(&staged);
+  return result;
+}
+
+void print_bench_json(const BenchResult *results, int count) {
+  printf("{\n  \"results\": [\n");
+  for (int i = 0; i < count; i++) {
+    const BenchResult *r = &results[i];
+    double cells = (double)r->size * r->size;
+    printf("    {\"terrain\": \"%s\", \"size\": %d, \"sweep\": "
+           "{\"runs\": %d, \"seconds\": %.6f, \"ns_per_cell\": %.3f, "
+           "\"cycles_per_cell\": %.3f}",
+           terrain_names[r->terrain], r->size, r->sweep_runs, r->sweep_seconds,
+           r->sweep_seconds * 1e9 / cells, r->sweep_cycles / cells);
+    printf(", \"stages\": {\"fold_seconds\": %.6f, \"left_seconds\": %.6f, "
+           "\"right_seconds\": %.6f}",
+           r->fold_seconds, r->left_seconds, r->right_seconds);
+    if (r->profiled) {
+      printf(", \"cells\": {\"reach_seconds\": %.6f, \"seconds\": %.6f}",
+             r->reach_seconds, r->cells_seconds);
+    } else {
+      printf(", \"cells\": null");
+    }
+    printf(", \"matches\": %s}%s\n", r->same ? "true" : "false",
+           i + 1 < count ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+void print_bench_row(const BenchResult *r) {
+  double cells = (double)r->size * r->size;
+  printf("%-13s %5d %8.4f s %9.1f %11.1f", terrain_names[r->terrain], r->size,
+         r->sweep_seconds, r->sweep_seconds * 1e9 / cells,
+         r->sweep_cycles / cells);
+  printf(" %8.4f s %8.4f s %8.4f s", r->fold_seconds, r->left_seconds,
+         r->right_seconds);
+  if (r->profiled) {
+    printf(" %8.4f s %8.4f s", r->reach_seconds, r->cells_seconds);
+  }
+  printf("%s\n", r->same ? "" : "  MISMATCH");
+}
+
+// every terrain at sizes 50 up to max_size
+void report_bench(int max_size, int profile_size, bool json) {
+  const int sizes[] = {50, 100, 200, 500, 1000, 2000, 4000};
+  int size_count = (int)(sizeof(sizes) / sizeof(int));
+  BenchResult *results =
+      (BenchResult *)calloc(TERRAIN_COUNT * size_count, sizeof(BenchResult));
+  int count = 0;
+  if (!json) {
+    printf("%-13s %5s %10s %9s %11s %10s %10s %10s %10s %10s\n", "terrain",
+           "size", "sweep", "ns/cell", "cycles/cell", "fold", "left",
+           "right", "reach", "cells");
+  }
+  for (int t = 0; t < TERRAIN_COUNT; t++) {
+    for (int s = 0; s < size_count && sizes[s] <= max_size; s++) {
+      results[count++] = bench_terrain((Terrain)t, sizes[s], profile_size);
+      if (!json) {
+        print_bench_row(&results[count - 1]);
+        fflush(stdout);
+      }
+    }
+  }
+  if (json) {
+    print_bench_json(results, count);
+  }
+  free(results);
+}
+
 int main(int argc, char *argv[]) {
+  if (argc > 1 && strcmp(argv[1], "scaling") == 0) {
+    int size = argc > 2 ? atoi(argv[2]) : 500;
+    int max_altitude = argc > 3 ? atoi(argv[3]) : 1000;
+    report_scaling(size, max_altitude);
+    return EXIT_SUCCESS;
+  }
+  if (argc > 1 && strcmp(argv[1], "incremental") == 0) {
+    int size = argc > 2 ? atoi(argv[2]) : 500;
+    int max_altitude = argc > 3 ? atoi(argv[3]) : 1000;
+    report_incremental(size, max_altitude);
+    return EXIT_SUCCESS;
+  }
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    bool json = strcmp(argv[argc - 1], "json") == 0;
+    int numbers = argc - 2 - (json ? 1 : 0);
+    int max_size = numbers > 0 ? atoi(argv[2]) : 1000;
+    int profile_size = numbers > 1 ? atoi(argv[3]) : 200;
+    report_bench(max_size, profile_size, json);
+    return EXIT_SUCCESS;
+  }
+  if (argc > 1 && strcmp(argv[1], "query") == 0) {
+    int size = argc > 2 ? atoi(argv[2]) : 500;
+    int max_altitude = argc > 3 ? atoi(argv[3]) : 1000;
+    int count = argc > 4 ? atoi(argv[4]) : 1000;
+    report_query(size, max_altitude, count);
+    return EXIT_SUCCESS;
+  }
+  if (argc > 1 && strcmp(argv[1], "reach") == 0) {
+    int size = argc > 2 ? atoi(argv[2]) : 150;
+    int max_altitude = argc > 3 ? atoi(argv[3]) : 1000;
+    report_reach(size, max_altitude);
+    return EXIT_SUCCESS;
+  }
+  if (argc > 1) {
+    int width = atoi(argv[1]);
+    int height = argc > 2 ? atoi(argv[2]) : width;
+    int max_altitude = argc > 3 ? atoi(argv[3]) : 1000;
+    if (width < 1 || height < 1 || max_altitude < 0) {
+      printf("usage: %s [width [height [max_altitude]]]\n"
+             "       %s scaling [size [max_altitude]]\n"
+             "       %s incremental [size [max_altitude]]\n"
+             "       %s reach [size [max_altitude]]\n"
+             "       %s query [size [max_altitude [count]]]\n"
+             "       %s bench [max_size [profile_size]] [json]\n",
+             argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+      return EXIT_FAILURE;
+    }
+    report_footprint(width, height, max_altitude);
+    return EXIT_SUCCESS;
+  }
+
   // clang-format off
   static int result[MAP_MAX][MAP_MAX];
 
@@ -350,6 +1831,7 @@ int main(int argc, char *argv[]) {
   };
   castleArea ( alt5, 25, result );
   compare_area ( alt5,  result, area5, 25 );
+  compare_engines ();
   return EXIT_SUCCESS;
 }
 #endif /* __PROGTEST__ */
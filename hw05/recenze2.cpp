@@ -7,6 +7,9 @@
 #include <stdio.h>
 
 #ifndef __PROGTEST__
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #define DEBUG(fmt) fprintf(stderr, "%s:%d " fmt, __FILE__, __LINE__);
 #define DEBUGF(fmt, ...)                                                       \
   fprintf(stderr, "%s:%d " fmt, __FILE__, __LINE__, __VA_ARGS__);
@@ -55,6 +58,13 @@ void list_insert(ArrayList *list, int index, void *element, int size) {
   list->size = new_size;
 }
 
+// index is not a byte offset
+void list_remove(ArrayList *list, int index, int size) {
+  char *start = (char *)list->allocation + index * size;
+  memmove(start, start + size, list->size - (index + 1) * size);
+  list->size -= size;
+}
+
 void list_reset(ArrayList *list) { list->size = 0; }
 void list_free(ArrayList *list) { free(list->allocation); }
 
@@ -177,6 +187,23 @@ void heap_push(BinaryHeap *heap, int value) {
   sift_up(heap, next_index);
 }
 
+// remove one occurrence of value, O(n) because the heap has to be searched
+bool heap_remove(BinaryHeap *heap, int value) {
+  int size = heap_get_size(heap);
+  for (int i = 0; i < size; i++) {
+    if (heap_get_value(heap, i) == value) {
+      heap_set_value(heap, i, heap_get_value(heap, size - 1));
+      heap->data.size -= sizeof(int);
+      if (i < size - 1) {
+        sift_up(heap, i);
+        sift_down(heap, i);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
 int heap_pop(BinaryHeap *heap) {
   int size = heap_get_size(heap);
   if (size == 0) {
@@ -193,71 +220,372 @@ int heap_pop(BinaryHeap *heap) {
   return root_value;
 }
 
+// d-ary heap
+// https://en.wikipedia.org/wiki/D-ary_heap
+//
+// The same as the BinaryHeap, but every node has Arity children:
+//  - parent(i) = (i - 1) / Arity
+//  - first_child(i) = Arity * i + 1
+// A wider node makes the tree shallower, and its children are next to each
+// other, so sifting down reads a cache line or so per level instead of
+// jumping between lines. The order is a compile time Less, so there is no
+// min/max flag and no negating, and the values are a typed buffer instead of
+// the bytes of an ArrayList. The soup uses it, the BinaryHeap stays as the
+// baseline of --bench-heap.
+
+// Less(a, b) is true if a belongs above b, HeapLess makes a min-heap
+struct HeapLess {
+  bool operator()(int a, int b) const { return a < b; }
+};
+
+struct HeapGreater {
+  bool operator()(int a, int b) const { return a > b; }
+};
+
+template <typename T, typename Less, int Arity = 4> struct DaryHeap {
+  T *values;
+  int size;
+  int capacity;
+};
+
+template <typename T, typename Less, int Arity>
+void dary_free(DaryHeap<T, Less, Arity> *heap) {
+  free(heap->values);
+}
+
+template <typename T, typename Less, int Arity>
+void dary_sift_up(DaryHeap<T, Less, Arity> *heap, int index) {
+  Less less;
+  T *a = heap->values;
+  T x = a[index];
+  while (index != 0) {
+    int parent = (index - 1) / Arity;
+    if (!less(x, a[parent])) {
+      break;
+    }
+    a[index] = a[parent];
+    index = parent;
+  }
+  a[index] = x;
+}
+
+template <typename T, typename Less, int Arity>
+void dary_sift_down(DaryHeap<T, Less, Arity> *heap, int index) {
+  Less less;
+  T *a = heap->values;
+  int size = heap->size;
+  T x = a[index];
+  while (true) {
+    int first = Arity * index + 1;
+    if (first >= size) {
+      break;
+    }
+    int last = first + Arity < size ? first + Arity : size;
+    int best = first;
+    for (int child = first + 1; child < last; child++) {
+      if (less(a[child], a[best])) {
+        best = child;
+      }
+    }
+    if (!less(a[best], x)) {
+      break;
+    }
+    a[index] = a[best];
+    index = best;
+  }
+  a[index] = x;
+}
+
+template <typename T, typename Less, int Arity>
+void dary_push(DaryHeap<T, Less, Arity> *heap, T value) {
+  if (heap->size == heap->capacity) {
+    // linear growth like the ArrayList, 128 bytes of ints at a time
+    heap->capacity += 32;
+    heap->values = (T *)realloc(heap->values, heap->capacity * sizeof(T));
+  }
+  heap->values[heap->size++] = value;
+  dary_sift_up(heap, heap->size - 1);
+}
+
+template <typename T, typename Less, int Arity>
+T dary_root(const DaryHeap<T, Less, Arity> *heap) {
+  assert(heap->size > 0);
+  return heap->values[0];
+}
+
+template <typename T, typename Less, int Arity>
+T dary_pop(DaryHeap<T, Less, Arity> *heap) {
+  T root = dary_root(heap);
+  heap->values[0] = heap->values[--heap->size];
+  if (heap->size > 0) {
+    dary_sift_down(heap, 0);
+  }
+  return root;
+}
+
+// remove one occurrence of value, O(n) because the heap has to be searched
+template <typename T, typename Less, int Arity>
+bool dary_remove(DaryHeap<T, Less, Arity> *heap, T value) {
+  for (int i = 0; i < heap->size; i++) {
+    if (heap->values[i] == value) {
+      heap->values[i] = heap->values[--heap->size];
+      if (i < heap->size) {
+        dary_sift_up(heap, i);
+        dary_sift_down(heap, i);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fenwick (binary indexed) tree of counts
+// https://en.wikipedia.org/wiki/Fenwick_tree
+//
+// tree[i] (1-based) holds the sum of the counts in (i - lowbit(i), i], where
+// lowbit(i) is the lowest set bit of i. Adding to a count touches the O(log n)
+// nodes covering it, and the k-th smallest element is found by descending
+// from the highest power of two, taking every step that stays at or below k.
+
+typedef struct {
+  int size;
+  // highest power of two <= size
+  int top_bit;
+  int *tree;
+} FenwickTree;
+
+void fenwick_init(FenwickTree *fenwick, int size) {
+  fenwick->size = size;
+  fenwick->top_bit = 1;
+  while (fenwick->top_bit * 2 <= size) {
+    fenwick->top_bit *= 2;
+  }
+  fenwick->tree = (int *)calloc(size + 1, sizeof(int));
+}
+
+void fenwick_free(FenwickTree *fenwick) { free(fenwick->tree); }
+
+// index is 0-based
+void fenwick_add(FenwickTree *fenwick, int index, int delta) {
+  for (int i = index + 1; i <= fenwick->size; i += i & -i) {
+    fenwick->tree[i] += delta;
+  }
+}
+
+// index of the k-th (0-based) smallest element
+int fenwick_find(FenwickTree *fenwick, int k) {
+  int pos = 0;
+  for (int step = fenwick->top_bit; step > 0; step /= 2) {
+    int next = pos + step;
+    if (next <= fenwick->size && fenwick->tree[next] <= k) {
+      pos = next;
+      k -= fenwick->tree[next];
+    }
+  }
+  // pos is the last index with at most k elements before it, 1-based
+  return pos;
+}
+
+// Multiset of scores that knows its median, the lower one for an even count,
+// which is the score at index (size - 1) / 2 in sorted order.
+//
+// The heaps split the scores into a lower and an upper half, any score goes.
+// The other two backends count how many times every score is in, in a
+// FenwickTree, and find the median by descending it: the histogram has a
+// count for every score of a range, the ranks only for the distinct scores
+// given up front. Both insert, remove and find the median in O(log S), where
+// S is the size of the range or the number of distinct scores.
+
+typedef enum {
+  SOUP_HEAPS,
+  SOUP_HISTOGRAM,
+  SOUP_RANKS,
+} SoupBackend;
+
+// the widest score range that gets a histogram, 256 KiB of counts
+const unsigned SOUP_HISTOGRAM_MAX = 1 << 16;
+
 typedef struct {
-  BinaryHeap min;
-  BinaryHeap max;
+  SoupBackend backend;
+  // SOUP_HEAPS, the upper and the lower half
+  DaryHeap<int, HeapLess> min;
+  DaryHeap<int, HeapGreater> max;
+  // SOUP_HISTOGRAM and SOUP_RANKS
+  FenwickTree counts;
+  int size;
+  // score of counts[0] for SOUP_HISTOGRAM
+  int lowest;
+  // score of every count for SOUP_RANKS, ascending
+  int *values;
 } MedianSoup;
 
 void soup_init(MedianSoup *soup) {
-  heap_init(&soup->min, true);
-  heap_init(&soup->max, false);
+  soup->backend = SOUP_HEAPS;
+  soup->min = {};
+  soup->max = {};
+}
+
+// counts of the scores in [lowest, highest]
+void soup_init_histogram(MedianSoup *soup, int lowest, int highest) {
+  assert(lowest <= highest);
+  soup->backend = SOUP_HISTOGRAM;
+  soup->lowest = lowest;
+  soup->values = NULL;
+  soup->size = 0;
+  fenwick_init(&soup->counts, highest - lowest + 1);
+}
+
+int compare_int(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+int compare_uint64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// counts of the distinct values in scores[], only those can be inserted
+void soup_init_ranks(MedianSoup *soup, const int *scores, int count) {
+  soup->backend = SOUP_RANKS;
+  soup->size = 0;
+  soup->values = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+  memcpy(soup->values, scores, count * sizeof(int));
+  qsort(soup->values, count, sizeof(int), compare_int);
+  int distinct = 0;
+  for (int i = 0; i < count; i++) {
+    if (distinct == 0 || soup->values[distinct - 1] != soup->values[i]) {
+      soup->values[distinct++] = soup->values[i];
+    }
+  }
+  fenwick_init(&soup->counts, distinct > 0 ? distinct : 1);
+}
+
+// SOUP_HISTOGRAM if the range of the scores is narrow enough, SOUP_RANKS
+// otherwise
+void soup_init_for(MedianSoup *soup, const int *scores, int count, int lowest,
+                   int highest) {
+  if ((unsigned)(highest - lowest) < SOUP_HISTOGRAM_MAX) {
+    soup_init_histogram(soup, lowest, highest);
+  } else {
+    soup_init_ranks(soup, scores, count);
+  }
 }
 
 void soup_clear(MedianSoup *soup) {
-  list_reset(&soup->min.data);
-  list_reset(&soup->max.data);
+  if (soup->backend == SOUP_HEAPS) {
+    soup->min.size = 0;
+    soup->max.size = 0;
+  } else {
+    memset(soup->counts.tree, 0, (soup->counts.size + 1) * sizeof(int));
+    soup->size = 0;
+  }
 }
 
 void soup_free(MedianSoup *soup) {
-  heap_free(&soup->min);
-  heap_free(&soup->max);
+  if (soup->backend == SOUP_HEAPS) {
+    dary_free(&soup->min);
+    dary_free(&soup->max);
+  } else {
+    fenwick_free(&soup->counts);
+    free(soup->values);
+  }
 }
 
 void soup_rebalance(MedianSoup *soup) {
-  int min_size = heap_get_size(&soup->min);
-  int max_size = heap_get_size(&soup->max);
+  int min_size = soup->min.size;
+  int max_size = soup->max.size;
   if (abs(min_size - max_size) > 1) {
     if (max_size > min_size) {
-      heap_push(&soup->min, heap_pop(&soup->max));
+      dary_push(&soup->min, dary_pop(&soup->max));
     } else {
-      heap_push(&soup->max, heap_pop(&soup->min));
+      dary_push(&soup->max, dary_pop(&soup->min));
     }
   }
 }
 
 bool soup_is_empty(MedianSoup *soup) {
-  return heap_get_size(&soup->min) == 0 && heap_get_size(&soup->max) == 0;
+  if (soup->backend != SOUP_HEAPS) {
+    return soup->size == 0;
+  }
+  return soup->min.size == 0 && soup->max.size == 0;
+}
+
+// index of a score in counts
+int soup_key(MedianSoup *soup, int n) {
+  if (soup->backend == SOUP_HISTOGRAM) {
+    assert(n >= soup->lowest && n - soup->lowest < soup->counts.size);
+    return n - soup->lowest;
+  }
+  int *found = (int *)bsearch(&n, soup->values, soup->counts.size,
+                              sizeof(int), compare_int);
+  assert(found != NULL);
+  return (int)(found - soup->values);
+}
+
+// count a score that is already turned into its key delta more times, which
+// saves searching for it with SOUP_RANKS
+void soup_add_key(MedianSoup *soup, int key, int delta) {
+  assert(soup->backend != SOUP_HEAPS);
+  fenwick_add(&soup->counts, key, delta);
+  soup->size += delta;
 }
 
 int soup_median(MedianSoup *soup) {
   assert(!soup_is_empty(soup));
 
-  int min_size = heap_get_size(&soup->min);
-  int max_size = heap_get_size(&soup->max);
+  if (soup->backend != SOUP_HEAPS) {
+    int key = fenwick_find(&soup->counts, (soup->size - 1) / 2);
+    return soup->backend == SOUP_HISTOGRAM ? soup->lowest + key
+                                           : soup->values[key];
+  }
+
+  int min_size = soup->min.size;
+  int max_size = soup->max.size;
 
   assert(abs(min_size - max_size) <= 1);
 
   if (max_size >= min_size) {
-    return heap_get_root(&soup->max);
+    return dary_root(&soup->max);
   } else {
-    return heap_get_root(&soup->min);
+    return dary_root(&soup->min);
   }
 }
 
 void soup_insert(MedianSoup *soup, int n) {
-  BinaryHeap *heap = NULL;
-  // initialize if empty
-  if (soup_is_empty(soup)) {
-    heap = &soup->min;
+  if (soup->backend != SOUP_HEAPS) {
+    soup_add_key(soup, soup_key(soup, n), 1);
+    return;
+  }
+
+  // the upper half if empty
+  if (!soup_is_empty(soup) && n < soup_median(soup)) {
+    dary_push(&soup->max, n);
   } else {
-    int median = soup_median(soup);
-    if (n < median) {
-      heap = &soup->max;
-    } else {
-      heap = &soup->min;
-    }
+    dary_push(&soup->min, n);
   }
-  heap_push(heap, n);
+  soup_rebalance(soup);
+}
+
+// n has to be in the soup. O(log S) with counts, but O(n) with the heaps,
+// which have to be searched for it.
+void soup_remove(MedianSoup *soup, int n) {
+  if (soup->backend != SOUP_HEAPS) {
+    soup_add_key(soup, soup_key(soup, n), -1);
+    return;
+  }
+
+  // the lower half holds everything up to its root
+  bool removed = false;
+  if (soup->max.size > 0 && n <= dary_root(&soup->max)) {
+    removed = dary_remove(&soup->max, n);
+  }
+  if (!removed) {
+    removed = dary_remove(&soup->min, n);
+  }
+  assert(removed);
   soup_rebalance(soup);
 }
 
@@ -270,9 +598,170 @@ typedef struct {
   unsigned char day;
 
   unsigned score;
-  char *message;
+  // offset into the MessageArena << MESSAGE_LENGTH_BITS | length
+  uint64_t message;
 } Review;
 
+// the longest message, longer ones are cut into a message and garbage
+const int MESSAGE_MAX = 4096;
+const int MESSAGE_LENGTH_BITS = 13;
+
+// All the messages back to back, without terminators. Grows by half of its
+// size, as it's the one big allocation. The ArrayList grows linearly to fit
+// into the memory limit, which would make this quadratic.
+typedef struct {
+  char *data;
+  size_t size;
+  size_t capacity;
+} MessageArena;
+
+void arena_reserve(MessageArena *arena, size_t size) {
+  if (size > arena->capacity) {
+    size_t capacity = arena->capacity + arena->capacity / 2;
+    if (capacity < size) {
+      capacity = size + MESSAGE_MAX;
+    }
+    arena->data = (char *)realloc(arena->data, capacity);
+    arena->capacity = capacity;
+  }
+}
+
+void arena_free(MessageArena *arena) { free(arena->data); }
+
+// the text of a Review::message handle
+const char *review_message(const MessageArena *arena, uint64_t message,
+                           int *length) {
+  *length = (int)(message & ((1 << MESSAGE_LENGTH_BITS) - 1));
+  return arena->data + (message >> MESSAGE_LENGTH_BITS);
+}
+
+// Buffered reader, instead of scanf and getchar, which lock the stream and
+// interpret the format on every call. Can't be mixed with them, as it reads
+// ahead.
+typedef struct {
+  FILE *file;
+  char *buffer;
+  size_t pos;
+  size_t len;
+} InputReader;
+
+const size_t READER_BUFFER = 1 << 16;
+
+void reader_init(InputReader *reader, FILE *file) {
+  reader->file = file;
+  reader->buffer = (char *)malloc(READER_BUFFER);
+  reader->pos = 0;
+  reader->len = 0;
+}
+
+void reader_free(InputReader *reader) { free(reader->buffer); }
+
+// next byte without consuming it, or EOF
+int reader_peek(InputReader *reader) {
+  if (reader->pos == reader->len) {
+    reader->len = fread(reader->buffer, 1, READER_BUFFER, reader->file);
+    reader->pos = 0;
+    if (reader->len == 0) {
+      return EOF;
+    }
+  }
+  return (unsigned char)reader->buffer[reader->pos];
+}
+
+int reader_getc(InputReader *reader) {
+  int c = reader_peek(reader);
+  if (c != EOF) {
+    reader->pos++;
+  }
+  return c;
+}
+
+// isspace() of the "C" locale, what scanf skips
+bool is_space(int c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+// The loops below go through what's left of the buffer with a plain pointer,
+// and only look at the stream again when they run off its end.
+
+void reader_skip_space(InputReader *reader) {
+  do {
+    const char *p = reader->buffer + reader->pos;
+    const char *end = reader->buffer + reader->len;
+    while (p < end && is_space((unsigned char)*p)) {
+      p++;
+    }
+    reader->pos = p - reader->buffer;
+  } while (reader->pos == reader->len && reader_peek(reader) != EOF);
+}
+
+// scanf("%d"): whitespace, an optional sign and at least one digit. Like
+// glibc, the number is read as a saturated long and then cut to an int.
+bool reader_int(InputReader *reader, int *value) {
+  reader_skip_space(reader);
+  bool negative = false;
+  int c = reader_peek(reader);
+  if (c == '-' || c == '+') {
+    negative = c == '-';
+    reader->pos++;
+    c = reader_peek(reader);
+  }
+  if (c < '0' || c > '9') {
+    return false;
+  }
+  uint64_t n = 0;
+  // LONG_MAX + 1 fits the magnitude of LONG_MIN
+  const uint64_t limit = (uint64_t)INT64_MAX + 1;
+  do {
+    const char *p = reader->buffer + reader->pos;
+    const char *end = reader->buffer + reader->len;
+    while (p < end && *p >= '0' && *p <= '9') {
+      int digit = *p++ - '0';
+      n = n > (limit - digit) / 10 ? limit : n * 10 + digit;
+    }
+    reader->pos = p - reader->buffer;
+  } while (reader->pos == reader->len && reader_peek(reader) != EOF);
+  int64_t result = 0;
+  if (negative) {
+    result = n == limit ? INT64_MIN : -(int64_t)n;
+  } else {
+    result = n == limit ? INT64_MAX : (int64_t)n;
+  }
+  *value = (int)result;
+  return true;
+}
+
+// scanf("%4096s") appended to the arena, returns the length, 0 if there was
+// no word before the end of input
+int reader_word(InputReader *reader, MessageArena *arena) {
+  reader_skip_space(reader);
+  int length = 0;
+  while (length < MESSAGE_MAX) {
+    int c = reader_peek(reader);
+    if (c == EOF || is_space(c)) {
+      break;
+    }
+    // copy the rest of the word in the buffer at once
+    const char *start = reader->buffer + reader->pos;
+    const char *p = start;
+    const char *end = reader->buffer + reader->len;
+    if (end - p > MESSAGE_MAX - length) {
+      end = p + (MESSAGE_MAX - length);
+    }
+    while (p < end && !is_space((unsigned char)*p)) {
+      p++;
+    }
+    size_t chunk = p - start;
+    arena_reserve(arena, arena->size + chunk);
+    memcpy(arena->data + arena->size, start, chunk);
+    arena->size += chunk;
+    reader->pos += chunk;
+    length += (int)chunk;
+  }
+  return length;
+}
+
 bool is_leap(int y) { return (y % 100 == 0) ? (y % 400 == 0) : (y % 4 == 0); }
 
 int days_in_moth(int y, int m) {
@@ -290,54 +779,337 @@ uint32_t get_entry_timestamp(Review *entry) {
          (uint32_t)entry->day;
 }
 
-int read_review(Review *entry) {
+// the same as scanf("%d-%d-%d %d %4096s"), with the message in the arena
+int read_review(InputReader *reader, Review *entry, MessageArena *arena) {
   // + 2023-11-16 98 Fake_review
   // ^ already handled
   int year = 0;
   int month = 0;
   int day = 0;
   int score = 0;
-  char message_buf[4097] = {};
 
-  int matched =
-      scanf("%d-%d-%d %d %4096s", &year, &month, &day, &score, message_buf);
+  size_t message_offset = arena->size;
+  bool parsed = reader_int(reader, &year) && reader_getc(reader) == '-' &&
+                reader_int(reader, &month) && reader_getc(reader) == '-' &&
+                reader_int(reader, &day) && reader_int(reader, &score) &&
+                reader_word(reader, arena) > 0;
+  int message_len = (int)(arena->size - message_offset);
 
-  if (matched != 5 || year < 1 || month < 1 || month > 12 || day < 1 ||
+  if (!parsed || year < 1 || month < 1 || month > 12 || day < 1 ||
       day > days_in_moth(year, month) || score < 1) {
-    DEBUGF("+ review scanf failed: year %d, month %d, day %d, score %d, "
-           "message_buf %s, match %d\n",
-           year, month, day, score, message_buf, matched);
+    DEBUGF("+ review parsing failed: year %d, month %d, day %d, score %d, "
+           "message length %d\n",
+           year, month, day, score, message_len);
+    arena->size = message_offset;
     return 1;
   }
 
-  int message_len = strlen(message_buf);
-  char *message = (char *)malloc(message_len + 1);
-  memcpy(message, message_buf, message_len + 1);
-
   entry->year = (unsigned short)year;
   entry->month = (unsigned char)month;
   entry->day = (unsigned char)day;
   entry->score = (unsigned)score;
-  entry->message = message;
+  entry->message = (uint64_t)message_offset << MESSAGE_LENGTH_BITS |
+                   (uint64_t)message_len;
 
   return 0;
 }
 
-int last_in_day(int i, Review *reviews, int review_count) {
-  if (i >= review_count) {
-    return i;
+// The reviews by columns, so the searches only go through the timestamps and
+// scores, 8 bytes a review, and never touch the message handles. Review is
+// just what read_review fills in before it's pushed here.
+//
+// With a spill file (--stream), no column is kept per review, the memory
+// grows with the days instead: every day has its timestamp and its scores as
+// (score, count) pairs, and the scores and messages go to the spill file,
+// where they are read back for '?'.
+typedef struct {
+  // uint32_t, get_entry_timestamp of every review
+  ArrayList timestamps;
+  // int
+  ArrayList scores;
+  // uint64_t, Review::message
+  ArrayList messages;
+  // int, index of the first review of every day, followed by count
+  ArrayList day_starts;
+  // uint64_t, sum of the scores before every day, followed by the total
+  ArrayList day_sums;
+  int count;
+  int day_count;
+  uint32_t last_timestamp;
+  // range of the scores, picks the MedianSoup backend of the searches
+  int lowest_score;
+  int highest_score;
+
+  // the rest is only used with a spill file
+  FILE *spill;
+  uint64_t spill_size;
+  // uint64_t, spill offset of the first review of every day, followed by the
+  // spill_size
+  ArrayList spill_starts;
+  // uint32_t, get_entry_timestamp of every day
+  ArrayList day_timestamps;
+  // int, the score pairs, sorted by score and without repeats within a day,
+  // except in the last one, which is only compacted every now and then
+  ArrayList pair_scores;
+  ArrayList pair_counts;
+  // int, index of the first pair of every day, followed by the pair count
+  ArrayList pair_starts;
+  // pairs of the last day after its last compaction
+  int compacted_pairs;
+} ReviewStore;
+
+// turns the pairs of the last day into one per score
+void store_compact_day(ReviewStore *store) {
+  int *scores = (int *)store->pair_scores.allocation;
+  int *counts = (int *)store->pair_counts.allocation;
+  int *pair_starts = (int *)store->pair_starts.allocation;
+  int first = pair_starts[store->day_count - 1];
+  int end = pair_starts[store->day_count];
+
+  // the scores are positive, a pair sorts by its score as one number
+  uint64_t *pairs = (uint64_t *)malloc((end - first) * sizeof(uint64_t));
+  for (int i = first; i < end; i++) {
+    pairs[i - first] = (uint64_t)scores[i] << 32 | (uint32_t)counts[i];
+  }
+  qsort(pairs, end - first, sizeof(uint64_t), compare_uint64);
+  int last = first - 1;
+  for (int i = 0; i < end - first; i++) {
+    int score = (int)(pairs[i] >> 32);
+    int count = (int)(uint32_t)pairs[i];
+    if (last >= first && scores[last] == score) {
+      counts[last] += count;
+    } else {
+      last++;
+      scores[last] = score;
+      counts[last] = count;
+    }
+  }
+  free(pairs);
+
+  pair_starts[store->day_count] = last + 1;
+  store->pair_scores.size = (last + 1) * sizeof(int);
+  store->pair_counts.size = (last + 1) * sizeof(int);
+  store->compacted_pairs = last + 1 - first;
+}
+
+// the reviews have to come in a non-decreasing order of their dates
+void store_push(ReviewStore *store, Review *entry) {
+  uint32_t timestamp = get_entry_timestamp(entry);
+  int score = (int)entry->score;
+  if (store->count == 0) {
+    int first = 0;
+    uint64_t nothing = 0;
+    list_push(&store->day_starts, &first, sizeof(int));
+    list_push(&store->day_sums, &nothing, sizeof(uint64_t));
+    if (store->spill) {
+      list_push(&store->pair_starts, &first, sizeof(int));
+      list_push(&store->spill_starts, &nothing, sizeof(uint64_t));
+    }
+    store->lowest_score = score;
+    store->highest_score = score;
+  }
+  int next = store->count + 1;
+  if (store->count == 0 || store->last_timestamp != timestamp) {
+    if (store->spill && store->count > 0) {
+      store_compact_day(store);
+    }
+    // the old end is the start of the new day
+    uint64_t total =
+        ((uint64_t *)store->day_sums.allocation)[store->day_count] + score;
+    list_push(&store->day_starts, &next, sizeof(int));
+    list_push(&store->day_sums, &total, sizeof(uint64_t));
+    if (store->spill) {
+      int pair_count = store->pair_scores.size / sizeof(int);
+      list_push(&store->pair_starts, &pair_count, sizeof(int));
+      list_push(&store->spill_starts, &store->spill_size, sizeof(uint64_t));
+      list_push(&store->day_timestamps, &timestamp, sizeof(uint32_t));
+      store->compacted_pairs = 0;
+    }
+    store->day_count++;
+  } else {
+    ((int *)store->day_starts.allocation)[store->day_count] = next;
+    ((uint64_t *)store->day_sums.allocation)[store->day_count] += score;
+    if (store->spill) {
+      ((uint64_t *)store->spill_starts.allocation)[store->day_count] =
+          store->spill_size;
+    }
+  }
+  store->count = next;
+  store->last_timestamp = timestamp;
+  if (score < store->lowest_score) {
+    store->lowest_score = score;
+  }
+  if (score > store->highest_score) {
+    store->highest_score = score;
+  }
+
+  if (store->spill) {
+    int one = 1;
+    list_push(&store->pair_scores, &score, sizeof(int));
+    list_push(&store->pair_counts, &one, sizeof(int));
+    int *pair_starts = (int *)store->pair_starts.allocation;
+    pair_starts[store->day_count]++;
+    int pairs =
+        pair_starts[store->day_count] - pair_starts[store->day_count - 1];
+    // amortized O(log) a review, and at most twice the memory of a compacted
+    // day
+    if (pairs > 2 * store->compacted_pairs + 64) {
+      store_compact_day(store);
+    }
+    return;
+  }
+  list_push(&store->timestamps, &timestamp, sizeof(uint32_t));
+  list_push(&store->scores, &score, sizeof(int));
+  list_push(&store->messages, &entry->message, sizeof(uint64_t));
+}
+
+// store_push with a spill file: the score and the message, which is the last
+// thing in the arena, are appended to the spill file, and the arena is
+// emptied again
+void store_push_spilled(ReviewStore *store, Review *entry,
+                        MessageArena *arena) {
+  assert(store->spill);
+  int length = 0;
+  const char *message = review_message(arena, entry->message, &length);
+  int header[2] = {(int)entry->score, length};
+  fwrite(header, sizeof(header), 1, store->spill);
+  fwrite(message, 1, length, store->spill);
+  store->spill_size += sizeof(header) + length;
+  arena->size = 0;
+  store_push(store, entry);
+}
+
+void store_free(ReviewStore *store) {
+  list_free(&store->timestamps);
+  list_free(&store->scores);
+  list_free(&store->messages);
+  list_free(&store->day_starts);
+  list_free(&store->day_sums);
+  list_free(&store->spill_starts);
+  list_free(&store->day_timestamps);
+  list_free(&store->pair_scores);
+  list_free(&store->pair_counts);
+  list_free(&store->pair_starts);
+  if (store->spill) {
+    fclose(store->spill);
+  }
+}
+
+// the per review columns, not with a spill file
+const uint32_t *store_timestamps(const ReviewStore *store) {
+  assert(!store->spill);
+  return (const uint32_t *)store->timestamps.allocation;
+}
+
+const int *store_scores(const ReviewStore *store) {
+  assert(!store->spill);
+  return (const int *)store->scores.allocation;
+}
+
+const uint64_t *store_messages(const ReviewStore *store) {
+  assert(!store->spill);
+  return (const uint64_t *)store->messages.allocation;
+}
+
+// day_count + 1 entries, the last one is count
+const int *store_day_starts(const ReviewStore *store) {
+  return (const int *)store->day_starts.allocation;
+}
+
+// number of reviews in the days [first_day, last_day]
+int store_day_reviews(const ReviewStore *store, int first_day, int last_day) {
+  const int *day_starts = store_day_starts(store);
+  return day_starts[last_day + 1] - day_starts[first_day];
+}
+
+// sum of the scores in the days [first_day, last_day]
+uint64_t store_day_sum(const ReviewStore *store, int first_day,
+                       int last_day) {
+  const uint64_t *day_sums = (const uint64_t *)store->day_sums.allocation;
+  return day_sums[last_day + 1] - day_sums[first_day];
+}
+
+// allocated bytes, the arena with the message texts not included
+size_t store_footprint(const ReviewStore *store) {
+  return (size_t)store->timestamps.capacity + store->scores.capacity +
+         store->messages.capacity + store->day_starts.capacity +
+         store->day_sums.capacity + store->spill_starts.capacity +
+         store->day_timestamps.capacity + store->pair_scores.capacity +
+         store->pair_counts.capacity + store->pair_starts.capacity;
+}
+
+// The scores the searches go through: those of the reviews, or with a spill
+// file, those of the pairs with their counts. runs[day] is the first one of
+// the day, counts is NULL when every score counts once.
+const int *store_search_scores(const ReviewStore *store, int *count,
+                               const int **counts, const int **runs) {
+  if (store->spill) {
+    *count = store->pair_scores.size / sizeof(int);
+    *counts = (const int *)store->pair_counts.allocation;
+    *runs = (const int *)store->pair_starts.allocation;
+    return (const int *)store->pair_scores.allocation;
   }
+  *count = store->count;
+  *counts = NULL;
+  *runs = store_day_starts(store);
+  return store_scores(store);
+}
 
-  Review *start = &reviews[i];
-  uint32_t start_timestamp = get_entry_timestamp(start);
+// soup_init_for with the scores of all the reviews
+void soup_init_reviews(MedianSoup *soup, const ReviewStore *reviews) {
+  int count = 0;
+  const int *counts = NULL;
+  const int *runs = NULL;
+  const int *scores = store_search_scores(reviews, &count, &counts, &runs);
+  soup_init_for(soup, scores, count, reviews->lowest_score,
+                reviews->highest_score);
+}
+
+// the day of review i, a binary search in day_starts
+int store_day_of(const ReviewStore *store, int i) {
+  const int *day_starts = store_day_starts(store);
+  int lo = 0;
+  int hi = store->day_count - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (day_starts[mid] <= i) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
 
-  int j = i + 1;
-  for (; j < review_count; j++) {
-    if (start_timestamp != get_entry_timestamp(reviews + j)) {
+// prints the reviews of the days [first_day, last_day] from the spill file,
+// like the '?' query does
+void store_print_spilled(const ReviewStore *store, int first_day,
+                         int last_day) {
+  const uint64_t *spill_starts =
+      (const uint64_t *)store->spill_starts.allocation;
+  char message[MESSAGE_MAX];
+  fseek(store->spill, (long)spill_starts[first_day], SEEK_SET);
+  for (uint64_t offset = spill_starts[first_day];
+       offset < spill_starts[last_day + 1];) {
+    int header[2] = {};
+    if (fread(header, sizeof(header), 1, store->spill) != 1 ||
+        fread(message, 1, header[1], store->spill) != (size_t)header[1]) {
       break;
     }
+    printf("  %d: %.*s\n", header[0], header[1], message);
+    offset += sizeof(header) + header[1];
+  }
+  // store_push_spilled appends
+  fseek(store->spill, 0, SEEK_END);
+}
+
+// get_entry_timestamp of review i
+uint32_t store_timestamp(const ReviewStore *store, int i) {
+  if (store->spill) {
+    return ((const uint32_t *)store->day_timestamps.allocation)[store_day_of(
+        store, i)];
   }
-  return j - 1;
+  return store_timestamps(store)[i];
 }
 
 typedef struct {
@@ -347,28 +1119,70 @@ typedef struct {
   double average;
 } ResultWindow;
 
-void search_reviews(ArrayList *reviews, MedianSoup *window, int window_size,
-                    ResultWindow *result) {
-  int review_count = reviews->size / sizeof(Review);
+// The best window so far. A larger difference always wins, but only sets the
+// difference: the end timestamp and count are only updated when a tie is won,
+// by a later end or a longer window. So the outcome depends on the order in
+// which the windows are offered, which has to be the starts in ascending
+// order, and for every start its ends in ascending order.
+typedef struct {
+  double difference;
+  uint32_t end_timestamp;
+  int count;
+  ResultWindow result;
+} WindowWinner;
+
+double window_difference(const ResultWindow *window) {
+  return fabs(window->average - (double)window->median);
+}
+
+void winner_offer(WindowWinner *winner, const ResultWindow *window,
+                  uint32_t end_timestamp, int count) {
+  double difference = window_difference(window);
+
+  bool won = difference > winner->difference;
+  if (difference == winner->difference) {
+    if (end_timestamp > winner->end_timestamp ||
+        ((end_timestamp == winner->end_timestamp) && count > winner->count)) {
+      winner->end_timestamp = end_timestamp;
+      winner->count = count;
+      won = true;
+    }
+  }
+
+  if (won) {
+    winner->result = *window;
+    winner->difference = difference;
+  }
+}
+
+// The original engine, the window is rebuilt from scratch for every start.
+// O(n^2 log n), kept as the reference for search_reviews.
+void search_reviews_rebuild(const ReviewStore *reviews, MedianSoup *window,
+                            int window_size, ResultWindow *result) {
+  int review_count = reviews->count;
 
   assert(window_size > 0);
   assert(window_size <= review_count);
 
-  *result = {};
-  double winning_difference = 0.0;
-  uint32_t winning_end_timestamp = 0;
-  int winning_count = 0;
+  WindowWinner winner = {};
 
-  Review *reviews_ptr = (Review *)reviews->allocation;
-  for (int start = 0; start < review_count;) {
+  const uint32_t *timestamps = store_timestamps(reviews);
+  const int *scores = store_scores(reviews);
+  const int *day_starts = store_day_starts(reviews);
+  for (int start_day = 0; start_day < reviews->day_count; start_day++) {
+    int start = day_starts[start_day];
+    if (start + window_size - 1 >= review_count) {
+      break;
+    }
     soup_clear(window);
 
     uint64_t sum = 0;
-    int end = last_in_day(start + window_size - 1, reviews_ptr, review_count);
     int prev = start;
-    while (end < review_count) {
+    for (int end_day = store_day_of(reviews, start + window_size - 1);
+         end_day < reviews->day_count; end_day++) {
+      int end = day_starts[end_day + 1] - 1;
       for (int i = prev; i <= end; i++) {
-        unsigned score = reviews_ptr[i].score;
+        int score = scores[i];
         sum += score;
         soup_insert(window, score);
       }
@@ -379,102 +1193,1398 @@ void search_reviews(ArrayList *reviews, MedianSoup *window, int window_size,
 
       double average = double(sum) / double(count);
       assert(average > 0);
-      double difference = fabs(average - (double)median);
-
-      bool won = difference > winning_difference;
-      if (difference == winning_difference) {
-        uint32_t end_timestamp = get_entry_timestamp(reviews_ptr + end);
-        if (end_timestamp > winning_end_timestamp ||
-            ((end_timestamp == winning_end_timestamp) &&
-             count > winning_count)) {
-          winning_end_timestamp = end_timestamp;
-          winning_count = count;
-          won = true;
+
+      ResultWindow candidate = {start, end, median, average};
+      winner_offer(&winner, &candidate, timestamps[end], count);
+
+      prev = end + 1;
+    }
+  }
+
+  *result = winner.result;
+}
+
+// Scores of the current window. Days are added and removed as a whole,
+// [first_day, last_day] is what's in, their sum and count come from the
+// prefix sums of the ReviewStore.
+typedef struct {
+  MedianSoup *soup;
+  // soup_key of every score, unless the soup is SOUP_HEAPS
+  const int *keys;
+  // of store_search_scores
+  const int *scores;
+  const int *counts;
+  const int *runs;
+  int first_day;
+  int last_day;
+} SlidingWindow;
+
+void window_init(SlidingWindow *window, const ReviewStore *reviews,
+                 MedianSoup *soup, const int *keys) {
+  int count = 0;
+  window->soup = soup;
+  window->keys = keys;
+  window->scores =
+      store_search_scores(reviews, &count, &window->counts, &window->runs);
+  // the heaps only take the scores one by one
+  assert(keys || !window->counts);
+}
+
+void window_add_day(SlidingWindow *window, int day, int sign) {
+  for (int i = window->runs[day]; i < window->runs[day + 1]; i++) {
+    int score = window->scores[i];
+    if (window->keys) {
+      int delta = window->counts ? sign * window->counts[i] : sign;
+      soup_add_key(window->soup, window->keys[i], delta);
+    } else if (sign > 0) {
+      soup_insert(window->soup, score);
+    } else {
+      soup_remove(window->soup, score);
+    }
+  }
+}
+
+// Every window is a range of whole days [start day, end day] with at least
+// window_size reviews. Instead of refilling the window for every start, it is
+// moved like a snake: for one start the end goes up to the last day, then the
+// start day is dropped and the end comes back down for the next start, and so
+// on. Each step adds or removes a single day. The windows of a start are
+// collected in a buffer and offered to the WindowWinner with ascending ends,
+// so the result is the same as the one of search_reviews_rebuild.
+//
+// This does the start days [first_start_day, end_start_day) with an emptied
+// window, and only the ends from min_end_day on, `buffer` has room for a
+// window per day. Where the windows go is up to the WindowSink.
+typedef struct {
+  // A window of count reviews goes to every winner of a size up to count.
+  // The sizes are ascending, the smallest one is the window_size of
+  // slide_start_days.
+  WindowWinner *winners;
+  const int *sizes;
+  int winner_count;
+  // Instead of the winners, the windows can be kept for a later
+  // winner_offer, but only those at least as different as all the windows
+  // of the same start before them: the difference of a WindowWinner is the
+  // largest one it has seen, so the others can't change it anymore.
+  ArrayList *records;
+} WindowSink;
+
+void slide_start_days(const ReviewStore *reviews, SlidingWindow *window,
+                      int window_size, int first_start_day, int end_start_day,
+                      int min_end_day, ResultWindow *buffer,
+                      WindowSink *sink) {
+  const int *day_starts = store_day_starts(reviews);
+  int day_count = reviews->day_count;
+
+  soup_clear(window->soup);
+  window->first_day = first_start_day;
+  window->last_day = first_start_day - 1;
+  bool ascending = true;
+
+  for (int start_day = first_start_day; start_day < end_start_day;
+       start_day++) {
+    int first_end_day =
+        store_day_of(reviews, day_starts[start_day] + window_size - 1);
+    if (first_end_day < min_end_day) {
+      first_end_day = min_end_day;
+    }
+
+    while (window->first_day < start_day) {
+      window_add_day(window, window->first_day++, -1);
+    }
+    while (window->last_day < first_end_day) {
+      window_add_day(window, ++window->last_day, 1);
+    }
+
+    int buffered = day_count - first_end_day;
+    while (true) {
+      unsigned median = soup_median(window->soup);
+      double average =
+          double(store_day_sum(reviews, start_day, window->last_day)) /
+          double(store_day_reviews(reviews, start_day, window->last_day));
+      buffer[window->last_day - first_end_day] =
+          ResultWindow{day_starts[start_day],
+                       day_starts[window->last_day + 1] - 1, median, average};
+
+      int next_day = window->last_day + (ascending ? 1 : -1);
+      if (next_day < first_end_day || next_day >= day_count) {
+        break;
+      }
+      if (ascending) {
+        window_add_day(window, ++window->last_day, 1);
+      } else {
+        window_add_day(window, window->last_day--, -1);
+      }
+    }
+    ascending = !ascending;
+
+    double best = 0;
+    int eligible = 0;
+    for (int i = 0; i < buffered; i++) {
+      if (sink->records) {
+        double difference = window_difference(&buffer[i]);
+        if (difference >= best) {
+          best = difference;
+          list_push(sink->records, &buffer[i], sizeof(ResultWindow));
         }
+        continue;
+      }
+      int end = buffer[i].end;
+      int count = end - buffer[i].start + 1;
+      // the ends are ascending, and so are the counts
+      while (eligible < sink->winner_count && sink->sizes[eligible] <= count) {
+        eligible++;
       }
+      uint32_t end_timestamp = store_timestamp(reviews, end);
+      for (int w = 0; w < eligible; w++) {
+        winner_offer(&sink->winners[w], &buffer[i], end_timestamp, count);
+      }
+    }
+  }
+}
 
-      if (won) {
-        *result = ResultWindow{start, end, median, average};
-        winning_difference = difference;
+// soup_key of every store_search_scores for the counting soups, NULL for the
+// heaps
+int *soup_keys(MedianSoup *soup, const ReviewStore *reviews) {
+  if (soup->backend == SOUP_HEAPS) {
+    return NULL;
+  }
+  int count = 0;
+  const int *counts = NULL;
+  const int *runs = NULL;
+  const int *scores = store_search_scores(reviews, &count, &counts, &runs);
+  int *keys = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+  for (int i = 0; i < count; i++) {
+    keys[i] = soup_key(soup, scores[i]);
+  }
+  return keys;
+}
+
+// the start days with at least window_size reviews from them on
+int start_day_count(const ReviewStore *reviews, int window_size) {
+  return store_day_of(reviews, reviews->count - window_size) + 1;
+}
+
+// `window_soup` can be any soup that takes all the scores, but removing from
+// the heaps is O(n), soup_init_reviews picks one of the others.
+void search_reviews(const ReviewStore *reviews, MedianSoup *window_soup,
+                    int window_size, ResultWindow *result) {
+  assert(window_size > 0);
+  assert(window_size <= reviews->count);
+
+  int *keys = soup_keys(window_soup, reviews);
+  SlidingWindow window = {};
+  window_init(&window, reviews, window_soup, keys);
+
+  ResultWindow *buffer =
+      (ResultWindow *)malloc(reviews->day_count * sizeof(ResultWindow));
+  WindowWinner winner = {};
+  WindowSink sink = {&winner, &window_size, 1, NULL};
+  slide_start_days(reviews, &window, window_size, 0,
+                   start_day_count(reviews, window_size), 0, buffer, &sink);
+  *result = winner.result;
+
+  free(buffer);
+  free(keys);
+}
+
+// search_reviews for all the window_sizes in one go, results[i] is the one of
+// window_sizes[i]. A window of count reviews is a window of every size up to
+// count, so the windows of the smallest size are all the windows, and the
+// sweep over them feeds a WindowWinner for every size.
+void search_reviews_batch(const ReviewStore *reviews, MedianSoup *window_soup,
+                          const int *window_sizes, int size_count,
+                          ResultWindow *results) {
+  assert(size_count > 0);
+  int *sizes = (int *)malloc(size_count * sizeof(int));
+  memcpy(sizes, window_sizes, size_count * sizeof(int));
+  qsort(sizes, size_count, sizeof(int), compare_int);
+  int distinct = 0;
+  for (int i = 0; i < size_count; i++) {
+    assert(sizes[i] > 0 && sizes[i] <= reviews->count);
+    if (distinct == 0 || sizes[distinct - 1] != sizes[i]) {
+      sizes[distinct++] = sizes[i];
+    }
+  }
+
+  int *keys = soup_keys(window_soup, reviews);
+  SlidingWindow window = {};
+  window_init(&window, reviews, window_soup, keys);
+  ResultWindow *buffer =
+      (ResultWindow *)malloc(reviews->day_count * sizeof(ResultWindow));
+  WindowWinner *winners =
+      (WindowWinner *)calloc(distinct, sizeof(WindowWinner));
+  WindowSink sink = {winners, sizes, distinct, NULL};
+  slide_start_days(reviews, &window, sizes[0], 0,
+                   start_day_count(reviews, sizes[0]), 0, buffer, &sink);
+
+  for (int i = 0; i < size_count; i++) {
+    int *found = (int *)bsearch(&window_sizes[i], sizes, distinct,
+                                sizeof(int), compare_int);
+    results[i] = winners[found - sizes].result;
+  }
+
+  free(winners);
+  free(buffer);
+  free(keys);
+  free(sizes);
+}
+
+// Average and median of the reviews of the days [start_day, end_day], for
+// any window and not just the best one. The average comes from the prefix
+// sums, the median from filling `soup`, which has to take all the scores like
+// the one of soup_init_reviews. Returns 1 if the days are out of range.
+int review_window_stats(const ReviewStore *reviews, MedianSoup *soup,
+                        int start_day, int end_day, ResultWindow *stats) {
+  if (start_day < 0 || start_day > end_day || end_day >= reviews->day_count) {
+    return 1;
+  }
+
+  const int *day_starts = store_day_starts(reviews);
+  int count = 0;
+  const int *counts = NULL;
+  const int *runs = NULL;
+  const int *scores = store_search_scores(reviews, &count, &counts, &runs);
+  soup_clear(soup);
+  for (int i = runs[start_day]; i < runs[end_day + 1]; i++) {
+    if (counts) {
+      soup_add_key(soup, soup_key(soup, scores[i]), counts[i]);
+    } else {
+      soup_insert(soup, scores[i]);
+    }
+  }
+
+  stats->start = day_starts[start_day];
+  stats->end = day_starts[end_day + 1] - 1;
+  stats->median = soup_median(soup);
+  stats->average = double(store_day_sum(reviews, start_day, end_day)) /
+                   double(store_day_reviews(reviews, start_day, end_day));
+  return 0;
+}
+
+// Earlier answers of search_reviews, by window size. Reviews are only ever
+// appended, so an answer isn't thrown away when the review count changes, it
+// is extended: an entry keeps the records of slide_start_days for all its
+// start days, and only the windows that end in the new days, or in the last
+// old day if it grew, are computed and merged into them. The answer is those
+// records offered to a WindowWinner in order. The window still has to be
+// filled up to the new days once, so an update is linear in the reviews, but
+// not in the windows.
+typedef struct {
+  int window_size;
+  // reviews->count and day_count of the records, 0 before the first search
+  int review_count;
+  int day_count;
+  // ResultWindow, by start and ascending ends within a start
+  ArrayList records;
+  ResultWindow result;
+  // SearchCache::clock of the last lookup
+  long used;
+} CachedSearch;
+
+// the most window sizes kept
+const int SEARCH_CACHE_MAX = 16;
+// The most records kept over all the entries. An entry usually has a few
+// per start day, but it can take one for every window, so the least recently
+// used entries are dropped past this.
+const int SEARCH_CACHE_RECORDS_MAX = 1 << 19;
+
+// The soup and the soup_key of every score are shared by all the entries, a
+// slide empties the soup first and the keys don't depend on the window size.
+// They are extended with the new scores instead of being built for every
+// update, only a score the soup has no key for builds them again.
+typedef struct {
+  // CachedSearch, by ascending window_size
+  ArrayList entries;
+  long clock;
+  // of all the entries
+  int record_count;
+  MedianSoup soup;
+  bool has_soup;
+  // int, soup_key of store_search_scores, empty for SOUP_HEAPS
+  ArrayList keys;
+  // day_count the keys were made for, the last of those days can have
+  // changed since
+  int keyed_days;
+  // ResultWindow, a window per day for slide_start_days
+  ArrayList buffer;
+} SearchCache;
+
+void search_cache_free(SearchCache *cache) {
+  CachedSearch *entries = (CachedSearch *)cache->entries.allocation;
+  int entry_count = cache->entries.size / sizeof(CachedSearch);
+  for (int i = 0; i < entry_count; i++) {
+    list_free(&entries[i].records);
+  }
+  list_free(&cache->entries);
+  if (cache->has_soup) {
+    soup_free(&cache->soup);
+  }
+  list_free(&cache->keys);
+  list_free(&cache->buffer);
+}
+
+// whether soup_key has a key for the score
+bool soup_covers(const MedianSoup *soup, int n) {
+  if (soup->backend == SOUP_HISTOGRAM) {
+    return n >= soup->lowest && n - soup->lowest < soup->counts.size;
+  }
+  return bsearch(&n, soup->values, soup->counts.size, sizeof(int),
+                 compare_int) != NULL;
+}
+
+// brings the soup and the keys of the cache up to all the reviews, in the
+// time of the scores since the last call
+void search_cache_prepare(SearchCache *cache, const ReviewStore *reviews) {
+  int count = 0;
+  const int *counts = NULL;
+  const int *runs = NULL;
+  const int *scores = store_search_scores(reviews, &count, &counts, &runs);
+
+  // the last day keyed can have new scores, and with a spill file it can
+  // have been compacted
+  int first = cache->keyed_days > 0 ? runs[cache->keyed_days - 1] : 0;
+  bool covered = cache->has_soup;
+  for (int i = first; covered && i < count; i++) {
+    covered = cache->soup.backend == SOUP_HEAPS ||
+              soup_covers(&cache->soup, scores[i]);
+  }
+  if (!covered) {
+    if (cache->has_soup) {
+      soup_free(&cache->soup);
+    }
+    soup_init_reviews(&cache->soup, reviews);
+    cache->has_soup = true;
+    first = 0;
+  }
+
+  if (cache->soup.backend != SOUP_HEAPS) {
+    list_reserve(&cache->keys, count * sizeof(int));
+    int *keys = (int *)cache->keys.allocation;
+    for (int i = first; i < count; i++) {
+      keys[i] = soup_key(&cache->soup, scores[i]);
+    }
+    cache->keys.size = count * sizeof(int);
+  }
+  cache->keyed_days = reviews->day_count;
+  list_reserve(&cache->buffer, reviews->day_count * sizeof(ResultWindow));
+}
+
+// brings the records and the result of an entry up to all the reviews,
+// search_cache_prepare has to be called first
+void cached_search_update(SearchCache *cache, const ReviewStore *reviews,
+                          CachedSearch *entry) {
+  const int *day_starts = store_day_starts(reviews);
+  int dirty_day = 0;
+  if (entry->review_count > 0) {
+    dirty_day = entry->day_count;
+    if (day_starts[entry->day_count] > entry->review_count) {
+      // the last day got more reviews, its old windows don't exist anymore
+      dirty_day--;
+    }
+  }
+  int dirty_start = day_starts[dirty_day];
+
+  const int *keys = cache->soup.backend != SOUP_HEAPS
+                        ? (const int *)cache->keys.allocation
+                        : NULL;
+  SlidingWindow window = {};
+  window_init(&window, reviews, &cache->soup, keys);
+  ArrayList fresh = {};
+  WindowSink sink = {NULL, NULL, 0, &fresh};
+  slide_start_days(reviews, &window, entry->window_size, 0,
+                   start_day_count(reviews, entry->window_size), dirty_day,
+                   (ResultWindow *)cache->buffer.allocation, &sink);
+
+  // Every start has fresh records, as the last day is dirty. Behind the old
+  // records of a start, the fresh ones only count if they are at least as
+  // different as those.
+  const ResultWindow *old = (const ResultWindow *)entry->records.allocation;
+  int old_count = entry->records.size / sizeof(ResultWindow);
+  const ResultWindow *added = (const ResultWindow *)fresh.allocation;
+  int added_count = fresh.size / sizeof(ResultWindow);
+  ArrayList merged = {};
+  int i = 0;
+  for (int j = 0; j < added_count;) {
+    int start = added[j].start;
+    double best = 0;
+    for (; i < old_count && old[i].start == start; i++) {
+      if (old[i].end < dirty_start) {
+        list_push(&merged, (void *)&old[i], sizeof(ResultWindow));
+        best = window_difference(&old[i]);
+      }
+    }
+    for (; j < added_count && added[j].start == start; j++) {
+      if (window_difference(&added[j]) >= best) {
+        list_push(&merged, (void *)&added[j], sizeof(ResultWindow));
       }
+    }
+  }
+  assert(i == old_count);
+  list_free(&fresh);
+  cache->record_count += (merged.size - entry->records.size) /
+                         (int)sizeof(ResultWindow);
+  list_free(&entry->records);
+  entry->records = merged;
+  entry->review_count = reviews->count;
+  entry->day_count = reviews->day_count;
+
+  const ResultWindow *records = (const ResultWindow *)merged.allocation;
+  int record_count = merged.size / sizeof(ResultWindow);
+  WindowWinner winner = {};
+  for (int r = 0; r < record_count; r++) {
+    int end = records[r].end;
+    winner_offer(&winner, &records[r], store_timestamp(reviews, end),
+                 end - records[r].start + 1);
+  }
+  entry->result = winner.result;
+}
 
-      prev = end + 1;
-      end = last_in_day(end + 1, reviews_ptr, review_count);
+// frees the records of an entry, which is then computed from scratch again
+void cached_search_drop(SearchCache *cache, CachedSearch *entry) {
+  cache->record_count -= entry->records.size / (int)sizeof(ResultWindow);
+  list_free(&entry->records);
+  entry->records = ArrayList{};
+  entry->review_count = 0;
+  entry->day_count = 0;
+}
+
+// search_reviews through the cache, the least recently used window size is
+// dropped when it's full
+void search_cached(SearchCache *cache, const ReviewStore *reviews,
+                   int window_size, ResultWindow *result) {
+  assert(window_size > 0);
+  assert(window_size <= reviews->count);
+
+  cache->clock++;
+  CachedSearch *entries = (CachedSearch *)cache->entries.allocation;
+  int entry_count = cache->entries.size / sizeof(CachedSearch);
+  int lo = 0;
+  int hi = entry_count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (entries[mid].window_size < window_size) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
+  }
 
-    start = last_in_day(start, reviews_ptr, review_count) + 1;
+  if (lo == entry_count || entries[lo].window_size != window_size) {
+    if (entry_count == SEARCH_CACHE_MAX) {
+      int oldest = 0;
+      for (int i = 1; i < entry_count; i++) {
+        if (entries[i].used < entries[oldest].used) {
+          oldest = i;
+        }
+      }
+      cached_search_drop(cache, &entries[oldest]);
+      list_remove(&cache->entries, oldest, sizeof(CachedSearch));
+      if (oldest < lo) {
+        lo--;
+      }
+    }
+    CachedSearch entry = {};
+    entry.window_size = window_size;
+    list_insert(&cache->entries, lo, &entry, sizeof(CachedSearch));
+    entries = (CachedSearch *)cache->entries.allocation;
+  }
+
+  CachedSearch *entry = &entries[lo];
+  entry->used = cache->clock;
+  if (entry->review_count != reviews->count) {
+    search_cache_prepare(cache, reviews);
+    cached_search_update(cache, reviews, entry);
+  }
+  *result = entry->result;
+
+  // the records of the other entries go first, the least recently used ones
+  // before the others
+  entry_count = cache->entries.size / sizeof(CachedSearch);
+  while (cache->record_count > SEARCH_CACHE_RECORDS_MAX) {
+    CachedSearch *oldest = NULL;
+    for (int i = 0; i < entry_count; i++) {
+      if (entries[i].records.size > 0 &&
+          (oldest == NULL || entries[i].used < oldest->used)) {
+        oldest = &entries[i];
+      }
+    }
+    cached_search_drop(cache, oldest);
   }
 }
 
-int user_search_reviews(char command, ArrayList *reviews, MedianSoup *window) {
+int user_search_reviews(char command, InputReader *reader,
+                        const ReviewStore *reviews, const MessageArena *arena,
+                        SearchCache *cache) {
   int window_count = 0;
-  int matched = scanf("%d", &window_count);
+  bool matched = reader_int(reader, &window_count);
 
-  if (matched != 1 || window_count < 1) {
-    DEBUGF("search scanf failed: commad '%c', count %d, matched %d\n", command,
-           window_count, matched);
+  if (!matched || window_count < 1) {
+    DEBUGF("search parsing failed: commad '%c', count %d, matched %d\n",
+           command, window_count, matched);
     return 1;
   }
 
-  int review_count = reviews->size / sizeof(Review);
-  if (window_count > review_count) {
+  if (window_count > reviews->count) {
     printf("Neexistuje.\n");
     return 0;
   }
 
   ResultWindow result = {};
-  search_reviews(reviews, window, window_count, &result);
+  search_cached(cache, reviews, window_count, &result);
+
+  // year << 16 | month << 8 | day
+  uint32_t start = store_timestamp(reviews, result.start);
+  uint32_t end = store_timestamp(reviews, result.end);
+
+  printf("%u-%02u-%02u - %u-%02u-%02u: %.6f %u\n", start >> 16,
+         start >> 8 & 0xff, start & 0xff, end >> 16, end >> 8 & 0xff,
+         end & 0xff, result.average, result.median);
+
+  if (command == '?' && reviews->spill) {
+    store_print_spilled(reviews, store_day_of(reviews, result.start),
+                        store_day_of(reviews, result.end));
+  } else if (command == '?') {
+    const int *scores = store_scores(reviews);
+    const uint64_t *messages = store_messages(reviews);
+    for (int i = result.start; i <= result.end; i++) {
+      int length = 0;
+      const char *message = review_message(arena, messages[i], &length);
+      printf("  %d: %.*s\n", scores[i], length, message);
+    }
+  }
 
-  Review *reviews_ptr = (Review *)reviews->allocation;
-  Review *start = (reviews_ptr) + result.start;
-  Review *end = (reviews_ptr) + result.end;
+  return 0;
+}
 
-  printf("%d-%02d-%02d - %d-%02d-%02d: %.6f %u\n", start->year, start->month,
-         start->day, end->year, end->month, end->day, result.average,
-         result.median);
+void bad() { printf("Nespravny vstup.\n"); }
 
-  if (command == '?') {
-    for (int i = result.start; i <= result.end; i++) {
-      Review *review = reviews_ptr + i;
-      printf("  %d: %s\n", review->score, review->message);
+#ifndef __PROGTEST__
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// search_reviews on threads. The start days are cut into chunks, which the
+// threads take one by one, each with its own soup and window. A chunk starts
+// from an empty window, so it costs one extra fill. The records of the chunks
+// are offered in order afterwards, which gives exactly the serial result.
+// Only the benchmark uses it, the submitted search stays on one thread.
+typedef struct {
+  const ReviewStore *reviews;
+  // shared, all the soups come from soup_init_reviews
+  const int *keys;
+  int window_size;
+  // start days per chunk
+  int band;
+  int chunk_count;
+  int next_chunk;
+  // of every chunk
+  ArrayList *records;
+} SearchJob;
+
+void *search_worker(void *arg) {
+  SearchJob *job = (SearchJob *)arg;
+  MedianSoup soup = {};
+  soup_init_reviews(&soup, job->reviews);
+  SlidingWindow window = {};
+  window_init(&window, job->reviews, &soup, job->keys);
+  ResultWindow *buffer =
+      (ResultWindow *)malloc(job->reviews->day_count * sizeof(ResultWindow));
+  int start_days = start_day_count(job->reviews, job->window_size);
+  while (true) {
+    int chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+    if (chunk >= job->chunk_count) {
+      break;
     }
+    int first = chunk * job->band;
+    int end = first + job->band;
+    if (end > start_days) {
+      end = start_days;
+    }
+    WindowSink sink = {NULL, NULL, 0, &job->records[chunk]};
+    slide_start_days(job->reviews, &window, job->window_size, first, end, 0,
+                     buffer, &sink);
   }
+  free(buffer);
+  soup_free(&soup);
+  return NULL;
+}
 
+// Below this many reviews the serial search takes around a millisecond or
+// less, which the soup every thread builds and starting the threads eat up:
+// --bench-threads 3000 60 4 ran at 0.36x with a window of 1500.
+const int PARALLEL_MIN_REVIEWS = 10000;
+
+void search_reviews_parallel(const ReviewStore *reviews, int window_size,
+                             int threads, ResultWindow *result) {
+  assert(window_size > 0);
+  assert(window_size <= reviews->count);
+  assert(threads >= 1);
+
+  MedianSoup soup = {};
+  soup_init_reviews(&soup, reviews);
+  if (threads == 1 || reviews->count < PARALLEL_MIN_REVIEWS) {
+    search_reviews(reviews, &soup, window_size, result);
+    soup_free(&soup);
+    return;
+  }
+  int *keys = soup_keys(&soup, reviews);
+  soup_free(&soup);
+
+  int start_days = start_day_count(reviews, window_size);
+  SearchJob job = {};
+  job.reviews = reviews;
+  job.keys = keys;
+  job.window_size = window_size;
+  job.band = start_days / (threads * 16);
+  if (job.band < 8) {
+    job.band = 8;
+  }
+  job.chunk_count = (start_days + job.band - 1) / job.band;
+  job.next_chunk = 0;
+  job.records = (ArrayList *)calloc(job.chunk_count, sizeof(ArrayList));
+
+  if (threads > job.chunk_count) {
+    threads = job.chunk_count;
+  }
+
+  pthread_t *handles = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  // the calling thread is one of the workers, it also takes over the chunks
+  // of any thread that could not be started
+  int started = 0;
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&handles[started], NULL, search_worker, &job) == 0) {
+      started++;
+    }
+  }
+  search_worker(&job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(handles[i], NULL);
+  }
+  free(handles);
+
+  WindowWinner winner = {};
+  for (int chunk = 0; chunk < job.chunk_count; chunk++) {
+    ResultWindow *records = (ResultWindow *)job.records[chunk].allocation;
+    int record_count = job.records[chunk].size / sizeof(ResultWindow);
+    for (int i = 0; i < record_count; i++) {
+      int end = records[i].end;
+      winner_offer(&winner, &records[i], store_timestamp(reviews, end),
+                   end - records[i].start + 1);
+    }
+    list_free(&job.records[chunk]);
+  }
+  *result = winner.result;
+
+  free(job.records);
+  free(keys);
+}
+
+// review_count reviews spread over day_count consecutive days, with random
+// scores between 1 and max_score
+void bench_reviews(ReviewStore *reviews, int review_count, int day_count,
+                   unsigned max_score, unsigned *seed) {
+  int year = 2000;
+  int month = 1;
+  int day = 1;
+  int day_index = 0;
+  for (int i = 0; i < review_count; i++) {
+    // spread the reviews evenly over the days
+    while ((long long)i * day_count >=
+           (long long)(day_index + 1) * review_count) {
+      day_index++;
+      if (++day > days_in_moth(year, month)) {
+        day = 1;
+        if (++month > 12) {
+          month = 1;
+          year++;
+        }
+      }
+    }
+    *seed = *seed * 1103515245 + 12345;
+    Review review = {};
+    review.year = (unsigned short)year;
+    review.month = (unsigned char)month;
+    review.day = (unsigned char)day;
+    review.score = 1 + (*seed >> 8) % max_score;
+    store_push(reviews, &review);
+  }
+}
+
+// search_reviews with both counting soups against search_reviews_rebuild with
+// the heaps, for a few window sizes
+void run_bench(int review_count, int day_count, unsigned max_score) {
+  ReviewStore reviews = {};
+  unsigned seed = 7;
+  bench_reviews(&reviews, review_count, day_count, max_score, &seed);
+  MedianSoup heaps = {};
+  soup_init(&heaps);
+  MedianSoup ranks = {};
+  soup_init_ranks(&ranks, store_scores(&reviews), review_count);
+  // the bench scores start at 1
+  bool narrow = max_score - 1 < SOUP_HISTOGRAM_MAX;
+  MedianSoup histogram = {};
+  if (narrow) {
+    soup_init_histogram(&histogram, 1, (int)max_score);
+  }
+
+  printf("%d reviews over %d days, scores 1-%u\n", review_count, day_count,
+         max_score);
+  // the searches read the timestamps and scores, the day_starts are shared
+  size_t searched = sizeof(uint32_t) + sizeof(int);
+  printf("store %.2f B/review allocated, %zu B/review searched, "
+         "%zu B Review\n",
+         (double)store_footprint(&reviews) / review_count, searched,
+         sizeof(Review));
+  printf("%10s %12s %12s %9s %12s %9s\n", "window", "rebuild", "ranks",
+         "speedup", "histogram", "speedup");
+  const int divisors[] = {review_count, 10, 2, 1};
+  for (int i = 0; i < (int)(sizeof(divisors) / sizeof(int)); i++) {
+    int window_size = review_count / divisors[i];
+    if (window_size < 1) {
+      window_size = 1;
+    }
+
+    ResultWindow expected = {};
+    double start = now_seconds();
+    search_reviews_rebuild(&reviews, &heaps, window_size, &expected);
+    double rebuild_seconds = now_seconds() - start;
+    printf("%10d %10.4f s", window_size, rebuild_seconds);
+
+    MedianSoup *soups[] = {&ranks, narrow ? &histogram : NULL};
+    bool same = true;
+    for (int b = 0; b < 2; b++) {
+      if (soups[b] == NULL) {
+        printf(" %12s %9s", "-", "-");
+        continue;
+      }
+      ResultWindow result = {};
+      start = now_seconds();
+      search_reviews(&reviews, soups[b], window_size, &result);
+      double seconds = now_seconds() - start;
+      printf(" %10.4f s %8.1fx", seconds, rebuild_seconds / seconds);
+      same = same && result.start == expected.start &&
+             result.end == expected.end && result.median == expected.median &&
+             result.average == expected.average;
+
+      // the winner again, on its own
+      ResultWindow stats = {};
+      same = same &&
+             review_window_stats(&reviews, soups[b],
+                                 store_day_of(&reviews, result.start),
+                                 store_day_of(&reviews, result.end),
+                                 &stats) == 0 &&
+             stats.start == result.start && stats.end == result.end &&
+             stats.median == result.median && stats.average == result.average;
+    }
+    printf("%s\n", same ? "" : " MISMATCH");
+  }
+
+  soup_free(&heaps);
+  soup_free(&ranks);
+  if (narrow) {
+    soup_free(&histogram);
+  }
+  store_free(&reviews);
+}
+
+// search_reviews_parallel on 1 to max_threads threads against search_reviews,
+// for a few window sizes
+void run_thread_bench(int review_count, int day_count, int max_threads) {
+  ReviewStore reviews = {};
+  unsigned seed = 7;
+  bench_reviews(&reviews, review_count, day_count, 100, &seed);
+  MedianSoup soup = {};
+  soup_init_reviews(&soup, &reviews);
+
+  printf("%d reviews over %d days, %ld cores\n", review_count, day_count,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%10s %8s %12s %12s %9s\n", "window", "threads", "serial",
+         "parallel", "speedup");
+  const int divisors[] = {review_count, 10, 2};
+  for (int i = 0; i < (int)(sizeof(divisors) / sizeof(int)); i++) {
+    int window_size = review_count / divisors[i];
+    if (window_size < 1) {
+      window_size = 1;
+    }
+
+    ResultWindow expected = {};
+    double start = now_seconds();
+    search_reviews(&reviews, &soup, window_size, &expected);
+    double serial_seconds = now_seconds() - start;
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      ResultWindow result = {};
+      start = now_seconds();
+      search_reviews_parallel(&reviews, window_size, threads, &result);
+      double seconds = now_seconds() - start;
+      bool same = result.start == expected.start &&
+                  result.end == expected.end &&
+                  result.median == expected.median &&
+                  result.average == expected.average;
+      printf("%10d %8d %10.4f s %10.4f s %8.2fx%s\n", window_size, threads,
+             serial_seconds, seconds, serial_seconds / seconds,
+             same ? "" : " MISMATCH");
+    }
+  }
+
+  soup_free(&soup);
+  store_free(&reviews);
+}
+
+// size_count window sizes spread over the reviews, search_reviews for each
+// of them against one search_reviews_batch
+void run_batch_bench(int review_count, int day_count, int size_count) {
+  ReviewStore reviews = {};
+  unsigned seed = 7;
+  bench_reviews(&reviews, review_count, day_count, 100, &seed);
+  MedianSoup soup = {};
+  soup_init_reviews(&soup, &reviews);
+
+  int *sizes = (int *)malloc(size_count * sizeof(int));
+  for (int i = 0; i < size_count; i++) {
+    sizes[i] = 1 + (int)((long long)i * review_count / size_count);
+  }
+  ResultWindow *expected =
+      (ResultWindow *)malloc(size_count * sizeof(ResultWindow));
+  ResultWindow *results =
+      (ResultWindow *)malloc(size_count * sizeof(ResultWindow));
+
+  double start = now_seconds();
+  for (int i = 0; i < size_count; i++) {
+    search_reviews(&reviews, &soup, sizes[i], &expected[i]);
+  }
+  double looped_seconds = now_seconds() - start;
+  start = now_seconds();
+  search_reviews_batch(&reviews, &soup, sizes, size_count, results);
+  double batch_seconds = now_seconds() - start;
+
+  bool same = true;
+  for (int i = 0; i < size_count; i++) {
+    same = same && results[i].start == expected[i].start &&
+           results[i].end == expected[i].end &&
+           results[i].median == expected[i].median &&
+           results[i].average == expected[i].average;
+  }
+  printf("%d reviews over %d days, %d window sizes 1-%d\n", review_count,
+         day_count, size_count, sizes[size_count - 1]);
+  printf("  search_reviews       %10.4f s\n", looped_seconds);
+  printf("  search_reviews_batch %10.4f s %8.1fx%s\n", batch_seconds,
+         looped_seconds / batch_seconds, same ? "" : " MISMATCH");
+
+  free(results);
+  free(expected);
+  free(sizes);
+  soup_free(&soup);
+  store_free(&reviews);
+}
+
+// A dashboard: the reviews of bench_reviews come in a day at a time, and
+// after every day the same few window sizes are asked for, with
+// search_reviews from scratch and through a SearchCache.
+void run_cache_bench(int review_count, int day_count) {
+  ReviewStore all = {};
+  unsigned seed = 7;
+  bench_reviews(&all, review_count, day_count, 100, &seed);
+  const int *day_starts = store_day_starts(&all);
+  const int window_sizes[] = {1, 10, 100, 1000, review_count / 4};
+  const int size_count = sizeof(window_sizes) / sizeof(int);
+
+  ReviewStore reviews = {};
+  SearchCache cache = {};
+  double plain_seconds = 0;
+  double cached_seconds = 0;
+  int queries = 0;
+  bool same = true;
+  for (int day = 0; day < all.day_count; day++) {
+    for (int i = day_starts[day]; i < day_starts[day + 1]; i++) {
+      Review review = {};
+      uint32_t timestamp = store_timestamps(&all)[i];
+      review.year = (unsigned short)(timestamp >> 16);
+      review.month = (unsigned char)(timestamp >> 8);
+      review.day = (unsigned char)timestamp;
+      review.score = (unsigned)store_scores(&all)[i];
+      store_push(&reviews, &review);
+    }
+    for (int k = 0; k < size_count; k++) {
+      int window_size = window_sizes[k];
+      if (window_size < 1 || window_size > reviews.count) {
+        continue;
+      }
+      ResultWindow expected = {};
+      double start = now_seconds();
+      MedianSoup soup = {};
+      soup_init_reviews(&soup, &reviews);
+      search_reviews(&reviews, &soup, window_size, &expected);
+      soup_free(&soup);
+      plain_seconds += now_seconds() - start;
+
+      // asked twice, the second time is a hit
+      ResultWindow result = {};
+      start = now_seconds();
+      search_cached(&cache, &reviews, window_size, &result);
+      search_cached(&cache, &reviews, window_size, &result);
+      cached_seconds += now_seconds() - start;
+      queries++;
+      same = same && result.start == expected.start &&
+             result.end == expected.end && result.median == expected.median &&
+             result.average == expected.average;
+    }
+  }
+
+  printf("%d reviews over %d days, %d window sizes, %d queries\n",
+         review_count, day_count, size_count, queries);
+  printf("  search_reviews %10.4f s\n", plain_seconds);
+  printf("  search_cached  %10.4f s %8.1fx%s\n", cached_seconds,
+         plain_seconds / cached_seconds, same ? "" : " MISMATCH");
+
+  search_cache_free(&cache);
+  store_free(&reviews);
+  store_free(&all);
+}
+
+// pushes all the values into a min-heap and pops them again, returns the
+// seconds, the order they came out in goes into checksum
+double bench_binary_heap(const int *values, int count, uint64_t *checksum) {
+  BinaryHeap heap = {};
+  heap_init(&heap, true);
+  double start = now_seconds();
+  for (int i = 0; i < count; i++) {
+    heap_push(&heap, values[i]);
+  }
+  for (int i = 0; i < count; i++) {
+    *checksum = *checksum * 31 + heap_pop(&heap);
+  }
+  double seconds = now_seconds() - start;
+  heap_free(&heap);
+  return seconds;
+}
+
+template <int Arity>
+double bench_dary_heap(const int *values, int count, uint64_t *checksum) {
+  DaryHeap<int, HeapLess, Arity> heap = {};
+  double start = now_seconds();
+  for (int i = 0; i < count; i++) {
+    dary_push(&heap, values[i]);
+  }
+  for (int i = 0; i < count; i++) {
+    *checksum = *checksum * 31 + dary_pop(&heap);
+  }
+  double seconds = now_seconds() - start;
+  dary_free(&heap);
+  return seconds;
+}
+
+// push/pop throughput of the heaps, and soup_insert with the heaps
+void run_heap_bench(int count) {
+  int *values = (int *)malloc(count * sizeof(int));
+  unsigned seed = 7;
+  for (int i = 0; i < count; i++) {
+    seed = seed * 1103515245 + 12345;
+    values[i] = 1 + (int)((seed >> 4) % 1000000000);
+  }
+
+  printf("%d pushes, then as many pops\n", count);
+  uint64_t expected = 0;
+  double binary_seconds = bench_binary_heap(values, count, &expected);
+  printf("%-12s %10.4f s %8.2f M ops/s\n", "BinaryHeap", binary_seconds,
+         2 * count / binary_seconds / 1e6);
+  const char *names[] = {"DaryHeap 2", "DaryHeap 4", "DaryHeap 8"};
+  for (int i = 0; i < 3; i++) {
+    uint64_t checksum = 0;
+    double seconds = 0;
+    if (i == 0) {
+      seconds = bench_dary_heap<2>(values, count, &checksum);
+    } else if (i == 1) {
+      seconds = bench_dary_heap<4>(values, count, &checksum);
+    } else {
+      seconds = bench_dary_heap<8>(values, count, &checksum);
+    }
+    printf("%-12s %10.4f s %8.2f M ops/s %6.2fx%s\n", names[i], seconds,
+           2 * count / seconds / 1e6, binary_seconds / seconds,
+           checksum == expected ? "" : " MISMATCH");
+  }
+
+  MedianSoup soup = {};
+  soup_init(&soup);
+  double start = now_seconds();
+  uint64_t medians = 0;
+  for (int i = 0; i < count; i++) {
+    soup_insert(&soup, values[i]);
+    medians += soup_median(&soup);
+  }
+  double seconds = now_seconds() - start;
+  printf("%-12s %10.4f s %8.2f M ops/s (median sum %llu)\n", "soup_insert",
+         seconds, count / seconds / 1e6, (unsigned long long)medians);
+  soup_free(&soup);
+  free(values);
+}
+
+// the old read_review, for the ingestion benchmark
+int read_review_scanf(FILE *file, Review *entry, char **message) {
+  int year = 0;
+  int month = 0;
+  int day = 0;
+  int score = 0;
+  char message_buf[4097] = {};
+
+  int matched = fscanf(file, "%d-%d-%d %d %4096s", &year, &month, &day, &score,
+                       message_buf);
+
+  if (matched != 5 || year < 1 || month < 1 || month > 12 || day < 1 ||
+      day > days_in_moth(year, month) || score < 1) {
+    return 1;
+  }
+
+  int message_len = strlen(message_buf);
+  *message = (char *)malloc(message_len + 1);
+  memcpy(*message, message_buf, message_len + 1);
+
+  entry->year = (unsigned short)year;
+  entry->month = (unsigned char)month;
+  entry->day = (unsigned char)day;
+  entry->score = (unsigned)score;
   return 0;
 }
 
-void bad() { printf("Nespravny vstup.\n"); }
+// review_count "+" lines with scores between 1 and max_score and a new day
+// every hundred reviews or so
+void write_bench_log(FILE *file, int review_count, unsigned max_score) {
+  unsigned seed = 7;
+  int year = 2000;
+  int month = 1;
+  int day = 1;
+  for (int i = 0; i < review_count; i++) {
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 8) % 100 == 0 && ++day > days_in_moth(year, month)) {
+      day = 1;
+      if (++month > 12) {
+        month = 1;
+        year++;
+      }
+    }
+    seed = seed * 1103515245 + 12345;
+    int length = 4 + (seed >> 8) % 60;
+    fprintf(file, "+ %d-%02d-%02d %u ", year, month, day,
+            1 + (seed >> 16) % max_score);
+    for (int j = 0; j < length; j++) {
+      fputc('a' + (j * 7 + i) % 26, file);
+    }
+    fputc('\n', file);
+  }
+}
 
-int main() {
+// Parses a generated log of review_count "+" lines from a temporary file,
+// with fscanf and a malloc per message against the InputReader and the arena.
+void run_ingest_bench(int review_count) {
+  FILE *file = tmpfile();
+  if (file == NULL) {
+    printf("no temporary file\n");
+    return;
+  }
+  write_bench_log(file, review_count, 100);
+  double megabytes = ftell(file) / 1e6;
+
+  rewind(file);
+  ArrayList old_reviews = {};
+  ArrayList old_messages = {};
+  double start = now_seconds();
+  while (true) {
+    int command = fgetc(file);
+    if (command == EOF) {
+      break;
+    }
+    if (command != '+') {
+      continue;
+    }
+    Review entry = {};
+    char *message = NULL;
+    if (read_review_scanf(file, &entry, &message)) {
+      break;
+    }
+    list_push(&old_reviews, &entry, sizeof(Review));
+    list_push(&old_messages, &message, sizeof(char *));
+  }
+  double scanf_seconds = now_seconds() - start;
+
+  rewind(file);
+  InputReader reader = {};
+  reader_init(&reader, file);
+  MessageArena arena = {};
+  ReviewStore reviews = {};
+  start = now_seconds();
+  while (true) {
+    int command = reader_getc(&reader);
+    if (command == EOF) {
+      break;
+    }
+    if (command != '+') {
+      continue;
+    }
+    Review entry = {};
+    if (read_review(&reader, &entry, &arena)) {
+      break;
+    }
+    store_push(&reviews, &entry);
+  }
+  double reader_seconds = now_seconds() - start;
+
+  int count = reviews.count;
+  bool same = count == (int)(old_reviews.size / sizeof(Review)) &&
+              count == review_count;
+  for (int i = 0; same && i < count; i++) {
+    Review *b = (Review *)old_reviews.allocation + i;
+    int length = 0;
+    const char *message =
+        review_message(&arena, store_messages(&reviews)[i], &length);
+    const char *old_message = ((char **)old_messages.allocation)[i];
+    same = store_timestamps(&reviews)[i] == get_entry_timestamp(b) &&
+           store_scores(&reviews)[i] == (int)b->score &&
+           (int)strlen(old_message) == length &&
+           memcmp(message, old_message, length) == 0;
+  }
+
+  printf("%d reviews, %.1f MB\n", review_count, megabytes);
+  printf("  scanf + malloc %8.3f s %7.3f GB/s\n", scanf_seconds,
+         megabytes / 1e3 / scanf_seconds);
+  printf("  reader + arena %8.3f s %7.3f GB/s %s\n", reader_seconds,
+         megabytes / 1e3 / reader_seconds, same ? "" : "MISMATCH");
+
+  for (int i = 0; i < (int)(old_messages.size / sizeof(char *)); i++) {
+    free(((char **)old_messages.allocation)[i]);
+  }
+  list_free(&old_messages);
+  list_free(&old_reviews);
+  store_free(&reviews);
+  arena_free(&arena);
+  reader_free(&reader);
+  fclose(file);
+}
+
+// reads the whole log into the store, returns the seconds
+double bench_load(FILE *file, ReviewStore *reviews, MessageArena *arena) {
+  rewind(file);
+  InputReader reader = {};
+  reader_init(&reader, file);
+  double start = now_seconds();
+  while (true) {
+    int command = reader_getc(&reader);
+    if (command == EOF) {
+      break;
+    }
+    if (command != '+') {
+      continue;
+    }
+    Review entry = {};
+    if (read_review(&reader, &entry, arena)) {
+      break;
+    }
+    if (reviews->spill) {
+      store_push_spilled(reviews, &entry, arena);
+    } else {
+      store_push(reviews, &entry);
+    }
+  }
+  double seconds = now_seconds() - start;
+  reader_free(&reader);
+  return seconds;
+}
+
+// The same generated log loaded into the memory and --stream, with the bytes
+// they hold per review and a few searches, which have to agree.
+void run_stream_bench(int review_count, unsigned max_score) {
+  FILE *file = tmpfile();
+  ReviewStore streamed = {};
+  streamed.spill = tmpfile();
+  if (file == NULL || streamed.spill == NULL) {
+    printf("no temporary file\n");
+    if (file) {
+      fclose(file);
+    }
+    store_free(&streamed);
+    return;
+  }
+  write_bench_log(file, review_count, max_score);
+  double megabytes = ftell(file) / 1e6;
+
+  ReviewStore kept = {};
+  MessageArena kept_arena = {};
+  double kept_seconds = bench_load(file, &kept, &kept_arena);
+  MessageArena streamed_arena = {};
+  double streamed_seconds = bench_load(file, &streamed, &streamed_arena);
+
+  printf("%d reviews over %d days, scores 1-%u, %.1f MB\n", kept.count,
+         kept.day_count, max_score, megabytes);
+  printf("%10s %10s %10s %12s %12s %10s\n", "", "load", "GB/s", "resident",
+         "B/review", "B/day");
+  const char *names[] = {"memory", "--stream"};
+  ReviewStore *stores[] = {&kept, &streamed};
+  MessageArena *arenas[] = {&kept_arena, &streamed_arena};
+  double seconds[] = {kept_seconds, streamed_seconds};
+  for (int i = 0; i < 2; i++) {
+    size_t resident = store_footprint(stores[i]) + arenas[i]->capacity;
+    printf("%10s %8.3f s %10.3f %10.2f MB %12.2f %10.1f\n", names[i],
+           seconds[i], megabytes / 1e3 / seconds[i], resident / 1e6,
+           (double)resident / stores[i]->count,
+           (double)resident / stores[i]->day_count);
+  }
+  printf("spill file %.1f MB, %d score pairs\n", streamed.spill_size / 1e6,
+         (int)(streamed.pair_scores.size / sizeof(int)));
+
+  const int divisors[] = {kept.count, 10, 2};
+  for (int i = 0; i < (int)(sizeof(divisors) / sizeof(int)); i++) {
+    int window_size = kept.count / divisors[i];
+    if (window_size < 1) {
+      window_size = 1;
+    }
+    ResultWindow results[2] = {};
+    double search_seconds[2] = {};
+    for (int k = 0; k < 2; k++) {
+      SearchCache cache = {};
+      double start = now_seconds();
+      search_cached(&cache, stores[k], window_size, &results[k]);
+      search_seconds[k] = now_seconds() - start;
+      search_cache_free(&cache);
+    }
+    bool same = results[0].start == results[1].start &&
+                results[0].end == results[1].end &&
+                results[0].median == results[1].median &&
+                results[0].average == results[1].average;
+    printf("window %8d: memory %8.4f s, --stream %8.4f s%s\n", window_size,
+           search_seconds[0], search_seconds[1], same ? "" : " MISMATCH");
+  }
+
+  store_free(&kept);
+  store_free(&streamed);
+  arena_free(&kept_arena);
+  arena_free(&streamed_arena);
+  fclose(file);
+}
+#endif /* __PROGTEST__ */
+
+int main(int argc, char *argv[]) {
+#ifndef __PROGTEST__
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    int review_count = argc > 2 ? atoi(argv[2]) : 100000;
+    int day_count = argc > 3 ? atoi(argv[3]) : 1000;
+    unsigned max_score = argc > 4 ? (unsigned)atoi(argv[4]) : 100;
+    if (review_count < 1 || day_count < 1 || max_score < 1) {
+      printf("usage: %s --bench [reviews [days [max_score]]]\n", argv[0]);
+      return 1;
+    }
+    run_bench(review_count, day_count, max_score);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-threads") == 0) {
+    int review_count = argc > 2 ? atoi(argv[2]) : 100000;
+    int day_count = argc > 3 ? atoi(argv[3]) : 1000;
+    int max_threads = argc > 4 ? atoi(argv[4])
+                               : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (review_count < 1 || day_count < 1 || max_threads < 1) {
+      printf("usage: %s --bench-threads [reviews [days [max_threads]]]\n",
+             argv[0]);
+      return 1;
+    }
+    run_thread_bench(review_count, day_count, max_threads);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-batch") == 0) {
+    int review_count = argc > 2 ? atoi(argv[2]) : 100000;
+    int day_count = argc > 3 ? atoi(argv[3]) : 1000;
+    int size_count = argc > 4 ? atoi(argv[4]) : 32;
+    if (review_count < 1 || day_count < 1 || size_count < 1) {
+      printf("usage: %s --bench-batch [reviews [days [sizes]]]\n", argv[0]);
+      return 1;
+    }
+    run_batch_bench(review_count, day_count, size_count);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-cache") == 0) {
+    int review_count = argc > 2 ? atoi(argv[2]) : 20000;
+    int day_count = argc > 3 ? atoi(argv[3]) : 200;
+    if (review_count < 1 || day_count < 1) {
+      printf("usage: %s --bench-cache [reviews [days]]\n", argv[0]);
+      return 1;
+    }
+    run_cache_bench(review_count, day_count);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-heap") == 0) {
+    int count = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (count < 1) {
+      printf("usage: %s --bench-heap [count]\n", argv[0]);
+      return 1;
+    }
+    run_heap_bench(count);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-stream") == 0) {
+    int review_count = argc > 2 ? atoi(argv[2]) : 200000;
+    unsigned max_score = argc > 3 ? (unsigned)atoi(argv[3]) : 100;
+    if (review_count < 1 || max_score < 1) {
+      printf("usage: %s --bench-stream [reviews [max_score]]\n", argv[0]);
+      return 1;
+    }
+    run_stream_bench(review_count, max_score);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-ingest") == 0) {
+    int review_count = argc > 2 ? atoi(argv[2]) : 2000000;
+    if (review_count < 1) {
+      printf("usage: %s --bench-ingest [reviews]\n", argv[0]);
+      return 1;
+    }
+    run_ingest_bench(review_count);
+    return 0;
+  }
+  // keeps the memory down to the days, see ReviewStore
+  bool streaming = argc > 1 && strcmp(argv[1], "--stream") == 0;
+#else
+  (void)argc;
+  (void)argv;
+  bool streaming = false;
+#endif /* __PROGTEST__ */
   printf("Recenze:\n");
 
-  ArrayList reviews = {};
-  MedianSoup window = {};
-  soup_init(&window);
+  InputReader reader = {};
+  reader_init(&reader, stdin);
+  MessageArena arena = {};
+  ReviewStore reviews = {};
+  if (streaming) {
+    reviews.spill = tmpfile();
+    if (reviews.spill == NULL) {
+      printf("no temporary file\n");
+      return 1;
+    }
+  }
+  SearchCache cache = {};
 
   uint32_t prev_timestamp = 0;
-  uint32_t current_timestamp = 0;
 
   bool loop = true;
   while (loop) {
-    char command = getchar();
+    char command = reader_getc(&reader);
     switch (command) {
     case ' ':
     case '\n':
       continue;
     case '+': {
       Review entry = {};
-      if (read_review(&entry)) {
+      if (read_review(&reader, &entry, &arena)) {
         bad();
         loop = false;
       } else {
-        list_push(&reviews, &entry, sizeof(Review));
-        current_timestamp = get_entry_timestamp(&entry);
-
+        uint32_t current_timestamp = get_entry_timestamp(&entry);
         if (prev_timestamp > current_timestamp) {
           DEBUG("Bad order\n");
           bad();
           loop = false;
+        } else if (streaming) {
+          store_push_spilled(&reviews, &entry, &arena);
+        } else {
+          store_push(&reviews, &entry);
         }
         prev_timestamp = current_timestamp;
       }
@@ -484,8 +2594,8 @@ int main() {
     case '#':
       DEBUGF("%c\n", command);
       // a query when no reviews have been added is an error
-      if (reviews.size == 0 ||
-          user_search_reviews(command, &reviews, &window)) {
+      if (reviews.count == 0 ||
+          user_search_reviews(command, &reader, &reviews, &arena, &cache)) {
         bad();
         loop = false;
       }
@@ -502,13 +2612,9 @@ int main() {
     }
   }
 
-  int review_count = reviews.size / sizeof(Review);
-  for (int i = 0; i < review_count; i++) {
-    Review *review = ((Review *)reviews.allocation) + i;
-    free(review->message);
-  }
-
-  list_free(&reviews);
-  soup_free(&window);
+  search_cache_free(&cache);
+  store_free(&reviews);
+  arena_free(&arena);
+  reader_free(&reader);
   return 0;
 }
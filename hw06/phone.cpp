@@ -7,7 +7,13 @@
 #include <math.h>
 #include <stdio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifndef __PROGTEST__
+#include <time.h>
+
 #define DEBUG(fmt) fprintf(stderr, "%s:%d " fmt, __FILE__, __LINE__)
 #define DEBUGF(fmt, ...)                                                       \
   fprintf(stderr, "%s:%d " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
@@ -102,9 +108,13 @@ typedef int NodeHandle;
 constexpr NodeHandle TRIE_ROOT = 0;
 constexpr NodeHandle TRIE_NULL = -1;
 
+#ifdef TRIE_WIDE_NODES
+// the original layout, every node has a slot for each character
 typedef struct {
   int string_start;
   int string_end;
+  // contacts in the leaf data of this node and all below it
+  int subtree_count;
   ArrayList leaf_data;
   NodeHandle alphabet[ALPHABET_SIZE];
 } TrieNode;
@@ -112,20 +122,84 @@ typedef struct {
 typedef struct {
   ArrayList nodes;
 } Trie;
+#else
+// Nodes come in three sizes like the Node4, Node16 and Node256 of an adaptive
+// radix tree. The keys are the digits of numbers and T9 names, so no node has
+// more than 10 children and most of them only have one or two. Small and
+// medium nodes keep their keys sorted, a medium node has room for every digit.
+// Only the root is full, indexed by the key, so that it never moves.
+//
+// Each kind has its own array and the low bits of a handle say which one. A
+// small node that runs out of room moves to a medium one, so its handle
+// changes and the parent has to be updated.
+enum NodeKind { NODE_FULL, NODE_SMALL, NODE_MEDIUM, NODE_KINDS };
+constexpr int NODE_KIND_BITS = 2;
+constexpr int NODE_KIND_MASK = (1 << NODE_KIND_BITS) - 1;
+
+constexpr int SMALL_CHILDREN = 4;
+constexpr int MEDIUM_CHILDREN = 16;
+static_assert(MEDIUM_CHILDREN >= 10, "a medium node must fit every digit");
 
-void node_init(TrieNode *node) {
-  node->leaf_data = {};
+typedef struct {
+  ArrayList leaf_data;
+  int string_start;
+  int string_end;
+  // contacts in the leaf data of this node and all below it
+  int subtree_count;
+} TrieNode;
+
+typedef struct {
+  TrieNode node;
+  unsigned char child_count;
+  unsigned char keys[SMALL_CHILDREN];
+  NodeHandle children[SMALL_CHILDREN];
+} Node4;
+
+typedef struct {
+  TrieNode node;
+  unsigned char child_count;
+  unsigned char keys[MEDIUM_CHILDREN];
+  NodeHandle children[MEDIUM_CHILDREN];
+} Node16;
+
+typedef struct {
+  TrieNode node;
+  NodeHandle children[ALPHABET_SIZE];
+} NodeFull;
+
+static const int NODE_SIZES[NODE_KINDS] = {sizeof(NodeFull), sizeof(Node4),
+                                           sizeof(Node16)};
+
+typedef struct {
+  ArrayList nodes[NODE_KINDS];
+  // nodes left behind when they grew, chained through string_start
+  NodeHandle free_nodes[NODE_KINDS];
+} Trie;
+#endif
+
+#ifdef TRIE_WIDE_NODES
+TrieNode *trie_get(Trie *trie, NodeHandle handle) {
+  // assert(handle >= 0 && handle < (trie->nodes.size / (int)sizeof(TrieNode)));
+  TrieNode *nodes = (TrieNode *)trie->nodes.allocation;
+  return nodes + handle;
+}
+
+NodeHandle trie_alloc(Trie *trie) {
+  NodeHandle offset = trie->nodes.size / sizeof(TrieNode);
+  TrieNode empty = {};
   for (int i = 0; i < ALPHABET_SIZE; i++) {
-    node->alphabet[i] = -1;
+    empty.alphabet[i] = TRIE_NULL;
   }
+  list_push(&trie->nodes, &empty, sizeof(TrieNode));
+  return offset;
 }
 
 void trie_init(Trie *trie) {
   *trie = {};
   assert(trie->nodes.allocation == NULL);
-  TrieNode empty = {};
-  node_init(&empty);
-  list_push(&trie->nodes, &empty, sizeof(TrieNode));
+  NodeHandle root = trie_alloc(trie);
+  assert(root == TRIE_ROOT);
+  (void)root;
 }
 
 void trie_free(Trie *trie) {
@@ -137,22 +211,225 @@ void trie_free(Trie *trie) {
   }
   list_free(&trie->nodes);
 }
+#else
+NodeKind node_kind(NodeHandle handle) {
+  return (NodeKind)(handle & NODE_KIND_MASK);
+}
+
+TrieNode *trie_get(Trie *trie, NodeHandle handle) {
+  int kind = node_kind(handle);
+  char *nodes = (char *)trie->nodes[kind].allocation;
+  return (TrieNode *)(nodes + (size_t)(handle >> NODE_KIND_BITS) *
+                                  NODE_SIZES[kind]);
+}
+
+// an empty node of the kind, with no children and no string
+NodeHandle trie_alloc_kind(Trie *trie, NodeKind kind) {
+  NodeHandle handle = trie->free_nodes[kind];
+  if (handle != TRIE_NULL) {
+    trie->free_nodes[kind] = trie_get(trie, handle)->string_start;
+  } else {
+    ArrayList *nodes = trie->nodes + kind;
+    int offset = nodes->size / NODE_SIZES[kind];
+    handle = (offset << NODE_KIND_BITS) | kind;
+    list_reserve(nodes, nodes->size + NODE_SIZES[kind]);
+    nodes->size += NODE_SIZES[kind];
+  }
+
+  TrieNode *node = trie_get(trie, handle);
+  memset(node, 0, NODE_SIZES[kind]);
+  if (kind == NODE_FULL) {
+    NodeFull *full = (NodeFull *)node;
+    for (int i = 0; i < ALPHABET_SIZE; i++) {
+      full->children[i] = TRIE_NULL;
+    }
+  }
+  return handle;
+}
+
+NodeHandle trie_alloc(Trie *trie) { return trie_alloc_kind(trie, NODE_SMALL); }
+
+// the leaf data has to be moved out first
+void trie_release(Trie *trie, NodeHandle handle) {
+  int kind = node_kind(handle);
+  TrieNode *node = trie_get(trie, handle);
+  node->leaf_data = {};
+  node->string_start = trie->free_nodes[kind];
+  trie->free_nodes[kind] = handle;
+}
+
+void trie_init(Trie *trie) {
+  *trie = {};
+  for (int kind = 0; kind < NODE_KINDS; kind++) {
+    trie->free_nodes[kind] = TRIE_NULL;
+  }
+  NodeHandle root = trie_alloc_kind(trie, NODE_FULL);
+  assert(root == TRIE_ROOT);
+  (void)root;
+}
+
+void trie_free(Trie *trie) {
+  for (int kind = 0; kind < NODE_KINDS; kind++) {
+    ArrayList *nodes = trie->nodes + kind;
+    for (int offset = 0; offset < nodes->size; offset += NODE_SIZES[kind]) {
+      TrieNode *node = (TrieNode *)((char *)nodes->allocation + offset);
+      list_free(&node->leaf_data);
+    }
+    list_free(nodes);
+  }
+}
+
+// position of index among the keys, -1 if it isn't there. The four keys are
+// compared at once as bytes of a word, the lowest zero byte of keys ^ index is
+// the match (a borrow can only mark bytes above it).
+int small_find(const Node4 *small, int index) {
+  static_assert(SMALL_CHILDREN == sizeof(uint32_t), "keys must fill a word");
+  uint32_t keys;
+  memcpy(&keys, small->keys, sizeof(keys));
+  uint32_t x = keys ^ (0x01010101u * (uint32_t)index);
+  uint32_t zero = (x - 0x01010101u) & ~x & 0x80808080u;
+  zero &= (uint32_t)((1ull << (8 * small->child_count)) - 1);
+  return zero ? (int)(__builtin_ctz(zero) >> 3) : -1;
+}
+
+int medium_find(const Node16 *medium, int index) {
+#ifdef __SSE2__
+  __m128i keys = _mm_loadu_si128((const __m128i *)medium->keys);
+  __m128i match = _mm_cmpeq_epi8(keys, _mm_set1_epi8((char)index));
+  uint32_t mask = _mm_movemask_epi8(match) & ((1u << medium->child_count) - 1);
+  return mask ? __builtin_ctz(mask) : -1;
+#else
+  for (int i = 0; i < medium->child_count; i++) {
+    if (medium->keys[i] == index) {
+      return i;
+    }
+  }
+  return -1;
+#endif
+}
+
+// keeps the keys sorted, there has to be room for one more
+void keys_insert(unsigned char *keys, NodeHandle *children, int count,
+                 int index, NodeHandle child) {
+  int i = count;
+  for (; i > 0 && keys[i - 1] > index; i--) {
+    keys[i] = keys[i - 1];
+    children[i] = children[i - 1];
+  }
+  keys[i] = (unsigned char)index;
+  children[i] = child;
+}
+
+// moves a small node that is out of room into a medium one, returns its new
+// handle
+NodeHandle node_grow(Trie *trie, NodeHandle handle) {
+  assert(node_kind(handle) == NODE_SMALL);
+  NodeHandle grown = trie_alloc_kind(trie, NODE_MEDIUM);
+  Node4 *small = (Node4 *)trie_get(trie, handle);
+  Node16 *medium = (Node16 *)trie_get(trie, grown);
+  medium->node = small->node;
+  medium->child_count = small->child_count;
+  memcpy(medium->keys, small->keys, sizeof(small->keys));
+  memcpy(medium->children, small->children, sizeof(small->children));
+
+  trie_release(trie, handle);
+  return grown;
+}
+#endif
 
 NodeHandle trie_new_node(Trie *trie, int string_start, int string_end) {
   assert(string_start < string_end);
-  NodeHandle offset = trie->nodes.size / sizeof(TrieNode);
-  TrieNode empty = {};
-  node_init(&empty);
-  empty.string_start = string_start;
-  empty.string_end = string_end;
-  list_push(&trie->nodes, &empty, sizeof(TrieNode));
-  return offset;
+  NodeHandle handle = trie_alloc(trie);
+  TrieNode *node = trie_get(trie, handle);
+  node->string_start = string_start;
+  node->string_end = string_end;
+  return handle;
 }
 
-TrieNode *trie_get(Trie *trie, NodeHandle handle) {
-  // assert(handle >= 0 && handle < (trie->nodes.size / (int)sizeof(TrieNode)));
-  TrieNode *nodes = (TrieNode *)trie->nodes.allocation;
-  return nodes + handle;
+// where the child for index is stored, NULL if it isn't (a full node always
+// has a slot, holding TRIE_NULL when it's empty)
+NodeHandle *node_child_slot(Trie *trie, NodeHandle handle, int index) {
+  TrieNode *node = trie_get(trie, handle);
+#ifdef TRIE_WIDE_NODES
+  return node->alphabet + index;
+#else
+  switch (node_kind(handle)) {
+  case NODE_SMALL: {
+    Node4 *small = (Node4 *)node;
+    int i = small_find(small, index);
+    return i < 0 ? NULL : small->children + i;
+  }
+  case NODE_MEDIUM: {
+    Node16 *medium = (Node16 *)node;
+    int i = medium_find(medium, index);
+    return i < 0 ? NULL : medium->children + i;
+  }
+  default:
+    return ((NodeFull *)node)->children + index;
+  }
+#endif
+}
+
+NodeHandle node_child(Trie *trie, NodeHandle handle, int index) {
+  NodeHandle *slot = node_child_slot(trie, handle, index);
+  return slot ? *slot : TRIE_NULL;
+}
+
+// The node must not have a child for index yet. Returns the handle of the node
+// afterwards, it changes when the node had to grow.
+NodeHandle node_add_child(Trie *trie, NodeHandle handle, int index,
+                          NodeHandle child) {
+  assert(node_child(trie, handle, index) == TRIE_NULL);
+#ifndef TRIE_WIDE_NODES
+  NodeKind kind = node_kind(handle);
+  if (kind == NODE_SMALL &&
+      ((Node4 *)trie_get(trie, handle))->child_count == SMALL_CHILDREN) {
+    handle = node_grow(trie, handle);
+    kind = NODE_MEDIUM;
+  }
+
+  TrieNode *node = trie_get(trie, handle);
+  if (kind == NODE_SMALL) {
+    Node4 *small = (Node4 *)node;
+    keys_insert(small->keys, small->children, small->child_count, index,
+                child);
+    small->child_count++;
+    return handle;
+  }
+  if (kind == NODE_MEDIUM) {
+    Node16 *medium = (Node16 *)node;
+    assert(medium->child_count < MEDIUM_CHILDREN);
+    keys_insert(medium->keys, medium->children, medium->child_count, index,
+                child);
+    medium->child_count++;
+    return handle;
+  }
+#endif
+  *node_child_slot(trie, handle, index) = child;
+  return handle;
+}
+
+void node_push_children(Trie *trie, NodeHandle handle, ArrayList *stack) {
+  TrieNode *node = trie_get(trie, handle);
+#ifdef TRIE_WIDE_NODES
+  const NodeHandle *children = node->alphabet;
+  int count = ALPHABET_SIZE;
+#else
+  const NodeHandle *children = ((NodeFull *)node)->children;
+  int count = ALPHABET_SIZE;
+  if (node_kind(handle) == NODE_SMALL) {
+    children = ((Node4 *)node)->children;
+    count = ((Node4 *)node)->child_count;
+  } else if (node_kind(handle) == NODE_MEDIUM) {
+    children = ((Node16 *)node)->children;
+    count = ((Node16 *)node)->child_count;
+  }
+#endif
+  for (int i = 0; i < count; i++) {
+    if (children[i] != TRIE_NULL) {
+      list_push(stack, children + i, sizeof(NodeHandle));
+    }
+  }
 }
 
 int string_push(ArrayList *buffer, const char *string, int string_len) {
@@ -172,10 +449,8 @@ int get_alphabet_index(char c) {
 
 NodeHandle find_child(Trie *trie, NodeHandle handle, char key) {
   assert(key != 0);
-  TrieNode *node = trie_get(trie, handle);
-
   int index = get_alphabet_index(key);
-  return node->alphabet[index];
+  return node_child(trie, handle, index);
 }
 
 NodeHandle node_insert(Trie *trie, ArrayList *string, const char *key,
@@ -185,18 +460,22 @@ NodeHandle node_insert(Trie *trie, ArrayList *string, const char *key,
   int key_end = key_start + key_len;
   const char *str = string_get(string, 0);
 
+  // the parent links to current through parent_index, in case current grows
+  NodeHandle parent = TRIE_NULL;
+  int parent_index = 0;
   NodeHandle current = TRIE_ROOT;
   while (key_start < key_end) {
     char c = str[key_start];
     int index = get_alphabet_index(c);
 
-    TrieNode *current_ptr = trie_get(trie, current);
-    NodeHandle child = current_ptr->alphabet[index];
+    NodeHandle child = node_child(trie, current, index);
 
     if (child == TRIE_NULL) {
       NodeHandle inserted = trie_new_node(trie, key_start, key_end);
-      current_ptr = trie_get(trie, current);
-      current_ptr->alphabet[index] = inserted;
+      NodeHandle grown = node_add_child(trie, current, index, inserted);
+      if (grown != current) {
+        *node_child_slot(trie, parent, parent_index) = grown;
+      }
       return inserted;
     } else {
       TrieNode *child_ptr = trie_get(trie, child);
@@ -221,19 +500,20 @@ NodeHandle node_insert(Trie *trie, ArrayList *string, const char *key,
       //  |-----| -> |---------------|
       //  |-----| -> |----| -> |-----|
       //              inserted  child
+      parent = current;
+      parent_index = index;
       if (same_len == original_len) {
         current = child;
       } else {
         assert(same_len < original_len);
         NodeHandle inserted =
             trie_new_node(trie, key_start, key_start + same_len);
-        TrieNode *inserted_ptr = trie_get(trie, inserted);
-        current_ptr = trie_get(trie, current);
         child_ptr = trie_get(trie, child);
+        trie_get(trie, inserted)->subtree_count = child_ptr->subtree_count;
 
         int new_index = get_alphabet_index(original[same_len]);
-        current_ptr->alphabet[index] = inserted;
-        inserted_ptr->alphabet[new_index] = child;
+        *node_child_slot(trie, current, index) = inserted;
+        node_add_child(trie, inserted, new_index, child);
 
         child_ptr->string_start += same_len;
         assert(child_ptr->string_start < child_ptr->string_end);
@@ -257,8 +537,7 @@ NodeHandle node_find_prefix(Trie *trie, ArrayList *string, const char *key,
     char c = key[key_start];
     int index = get_alphabet_index(c);
 
-    TrieNode *current_ptr = trie_get(trie, current);
-    NodeHandle child = current_ptr->alphabet[index];
+    NodeHandle child = node_child(trie, current, index);
     if (child == TRIE_NULL) {
       return TRIE_NULL;
     }
@@ -284,6 +563,27 @@ NodeHandle node_find_prefix(Trie *trie, ArrayList *string, const char *key,
   return current;
 }
 
+// counts one more contact on every node on the way to key, which has to be in
+// the trie already
+void node_count_key(Trie *trie, const char *key, int key_len) {
+  NodeHandle current = TRIE_ROOT;
+  trie_get(trie, current)->subtree_count++;
+  int key_start = 0;
+  while (key_start < key_len) {
+    int index = get_alphabet_index(key[key_start]);
+    current = node_child(trie, current, index);
+    assert(current != TRIE_NULL);
+    TrieNode *current_ptr = trie_get(trie, current);
+    current_ptr->subtree_count++;
+    key_start += current_ptr->string_end - current_ptr->string_start;
+  }
+  assert(key_start == key_len);
+}
+
+int node_subtree_count(Trie *trie, NodeHandle handle) {
+  return handle == TRIE_NULL ? 0 : trie_get(trie, handle)->subtree_count;
+}
+
 void encode_t9(char *string) {
   for (int i = 0; string[i] != 0; i++) {
     string[i] = T9_LUT[(int)string[i]];
@@ -307,13 +607,7 @@ void collect_children(Trie *trie, NodeHandle node, ArrayList *stack,
 
     TrieNode *pop = trie_get(trie, handle);
     collect_leaf_data(pop, collected);
-
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-      NodeHandle child = pop->alphabet[i];
-      if (child != TRIE_NULL) {
-        list_push(stack, &child, sizeof(NodeHandle));
-      }
-    }
+    node_push_children(trie, handle, stack);
   }
 }
 
@@ -344,6 +638,50 @@ bool leaf_add_data(Trie *trie, NodeHandle handle, ArrayList *contacts,
   return false;
 }
 
+int common_prefix(const char *a, const char *b) {
+  int size = 0;
+  while (a[size] != 0 && a[size] == b[size]) {
+    size++;
+  }
+  return size;
+}
+
+// Puts the contact into the tries, t9_name is its name after encode_t9.
+// Returns true when the same contact is already there.
+//
+// Besides the number and T9 name tries, the prefix that the number and the T9
+// name have in common goes into both_trie. A query matching a contact by both
+// reaches it there too, so it is only counted once in the total.
+bool contact_insert(ArrayList *contacts, ArrayList *string, Trie *number_trie,
+                    Trie *t9_name_trie, Trie *both_trie, int new_contact,
+                    const char *t9_name) {
+  Contact *contact = (Contact *)contacts->allocation + new_contact;
+  const char *number = contact->number;
+  const char *name = contact->name;
+  int number_size = strlen(number);
+  int name_size = strlen(t9_name);
+
+  NodeHandle node = TRIE_NULL;
+  node = node_insert(number_trie, string, number, number_size);
+  if (leaf_add_data(number_trie, node, contacts, number, name, new_contact)) {
+    return true;
+  }
+  node_count_key(number_trie, number, number_size);
+
+  node = node_insert(t9_name_trie, string, t9_name, name_size);
+  if (leaf_add_data(t9_name_trie, node, contacts, number, name, new_contact)) {
+    return true;
+  }
+  node_count_key(t9_name_trie, t9_name, name_size);
+
+  int both_size = common_prefix(number, t9_name);
+  if (both_size > 0) {
+    node_insert(both_trie, string, number, both_size);
+    node_count_key(both_trie, number, both_size);
+  }
+  return false;
+}
+
 #define EXPECT(char)                                                           \
   if (*(line++) != char) {                                                     \
     DEBUGF("Unexpected character '%c'", char);                                 \
@@ -366,7 +704,7 @@ int expect_sequence(char **line, int (*function)(int), char end) {
 }
 
 void add_number(char *line, ArrayList *contacts, ArrayList *string,
-                Trie *number_trie, Trie *t9_name_trie) {
+                Trie *number_trie, Trie *t9_name_trie, Trie *both_trie) {
   // + 123456 Vagner Ladislav
   EXPECT('+')
   EXPECT(' ')
@@ -398,15 +736,9 @@ void add_number(char *line, ArrayList *contacts, ArrayList *string,
   int new_contact = contacts->size / sizeof(Contact);
   list_push(contacts, &contact, sizeof(Contact));
 
-  NodeHandle node = TRIE_NULL;
-  node = node_insert(number_trie, string, number, number_size);
-  if (leaf_add_data(number_trie, node, contacts, number, name, new_contact)) {
-    return exists();
-  }
-
   encode_t9(name_start);
-  node = node_insert(t9_name_trie, string, name_start, name_size);
-  if (leaf_add_data(t9_name_trie, node, contacts, number, name, new_contact)) {
+  if (contact_insert(contacts, string, number_trie, t9_name_trie, both_trie,
+                     new_contact, name_start)) {
     return exists();
   }
 
@@ -443,9 +775,23 @@ int int_dedup(int *array, int size) {
   return dst;
 }
 
+// contacts with a number or T9 name starting with prefix, each counted once,
+// number_found and t9_found get the nodes the prefix leads to
+int query_total(ArrayList *string, Trie *number_trie, Trie *t9_name_trie,
+                Trie *both_trie, const char *prefix, int prefix_size,
+                NodeHandle *number_found, NodeHandle *t9_found) {
+  *number_found = node_find_prefix(number_trie, string, prefix, prefix_size);
+  *t9_found = node_find_prefix(t9_name_trie, string, prefix, prefix_size);
+  NodeHandle both_found =
+      node_find_prefix(both_trie, string, prefix, prefix_size);
+  return node_subtree_count(number_trie, *number_found) +
+         node_subtree_count(t9_name_trie, *t9_found) -
+         node_subtree_count(both_trie, both_found);
+}
+
 void do_query(char *line, ArrayList *contacts, ArrayList *stack,
               ArrayList *collected, ArrayList *string, Trie *number_trie,
-              Trie *t9_name_trie) {
+              Trie *t9_name_trie, Trie *both_trie) {
   // ? 1234567
   EXPECT('?')
   EXPECT(' ')
@@ -456,26 +802,29 @@ void do_query(char *line, ArrayList *contacts, ArrayList *stack,
     return bad();
   }
 
-  list_reset(stack);
-  list_reset(collected);
-
-  NodeHandle found = TRIE_NULL;
-  found = node_find_prefix(number_trie, string, number_start, number_size);
-  if (found != TRIE_NULL) {
-    collect_children(number_trie, found, stack, collected);
-  }
-
-  found = node_find_prefix(t9_name_trie, string, number_start, number_size);
-  if (found != TRIE_NULL) {
-    collect_children(t9_name_trie, found, stack, collected);
-  }
+  NodeHandle number_found = TRIE_NULL;
+  NodeHandle t9_found = TRIE_NULL;
+  int total = query_total(string, number_trie, t9_name_trie, both_trie,
+                          number_start, number_size, &number_found, &t9_found);
+
+  // Every node but the root has leaf data or at least two children, so
+  // subtrees with at most ten contacts are small enough to go through.
+  if (total <= 10) {
+    list_reset(stack);
+    list_reset(collected);
+    if (number_found != TRIE_NULL) {
+      collect_children(number_trie, number_found, stack, collected);
+    }
+    if (t9_found != TRIE_NULL) {
+      collect_children(t9_name_trie, t9_found, stack, collected);
+    }
 
-  qsort(collected->allocation, collected->size / sizeof(int), sizeof(int),
-        compare_ints);
-  int collected_size =
-      int_dedup((int *)collected->allocation, collected->size / sizeof(int));
+    qsort(collected->allocation, collected->size / sizeof(int), sizeof(int),
+          compare_ints);
+    int collected_size =
+        int_dedup((int *)collected->allocation, collected->size / sizeof(int));
+    assert(collected_size == total);
 
-  if (collected_size <= 10) {
     for (int i = 0; i < collected_size; i++) {
       int index = ((int *)collected->allocation)[i];
       Contact *contact = ((Contact *)contacts->allocation) + index;
@@ -483,11 +832,287 @@ void do_query(char *line, ArrayList *contacts, ArrayList *stack,
     }
   }
 
-  printf("Celkem: %d\n", collected_size);
+  printf("Celkem: %d\n", total);
+}
+
+#ifndef __PROGTEST__
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// bytes the node arrays and the leaf lists hold on to, node_count gets the
+// nodes reachable from the root
+size_t trie_footprint(Trie *trie, int *node_count) {
+#ifdef TRIE_WIDE_NODES
+  size_t bytes = trie->nodes.capacity;
+#else
+  size_t bytes = 0;
+  for (int kind = 0; kind < NODE_KINDS; kind++) {
+    bytes += trie->nodes[kind].capacity;
+  }
+#endif
+  ArrayList stack = {};
+  *node_count = 0;
+  NodeHandle handle = TRIE_ROOT;
+  list_push(&stack, &handle, sizeof(NodeHandle));
+  while (stack.size > 0) {
+    list_pop(&stack, &handle, sizeof(NodeHandle));
+    bytes += trie_get(trie, handle)->leaf_data.capacity;
+    *node_count += 1;
+    node_push_children(trie, handle, &stack);
+  }
+  list_free(&stack);
+  return bytes;
+}
+
+// length random characters from set into buffer, which gets a terminator
+void random_string(char *buffer, int length, const char *set, int set_size,
+                   unsigned *seed) {
+  for (int i = 0; i < length; i++) {
+    *seed = *seed * 1103515245 + 12345;
+    buffer[i] = set[(*seed >> 8) % set_size];
+  }
+  buffer[length] = '\0';
+}
+
+// contact_count contacts with random numbers of 6 to 12 digits and names of
+// 4 to 19 characters, put into the tries the way add_number does
+void bench_contacts(ArrayList *contacts, ArrayList *string, Trie *number_trie,
+                    Trie *t9_name_trie, Trie *both_trie, int contact_count,
+                    unsigned *seed) {
+  const char *letters = "abcdefghijklmnopqrstuvwxyz ";
+  for (int i = 0; i < contact_count; i++) {
+    *seed = *seed * 1103515245 + 12345;
+    int number_size = 6 + (*seed >> 8) % 7;
+    char *number = (char *)malloc(number_size + 1);
+    random_string(number, number_size, "0123456789", 10, seed);
+    *seed = *seed * 1103515245 + 12345;
+    int name_size = 4 + (*seed >> 8) % 16;
+    char *name = (char *)malloc(name_size + 1);
+    // no leading space, add_number rejects those
+    random_string(name, name_size, letters, 27, seed);
+    name[0] = 'a' + name_size;
+    Contact contact = {number, name};
+    list_push(contacts, &contact, sizeof(Contact));
+  }
+
+  char t9[32];
+  for (int i = 0; i < contact_count; i++) {
+    Contact *contact = (Contact *)contacts->allocation + i;
+    memcpy(t9, contact->name, strlen(contact->name) + 1);
+    encode_t9(t9);
+    contact_insert(contacts, string, number_trie, t9_name_trie, both_trie, i,
+                   t9);
+  }
+}
+
+void bench_free(ArrayList *contacts, ArrayList *string, Trie *number_trie,
+                Trie *t9_name_trie, Trie *both_trie) {
+  int contacts_size = contacts->size / sizeof(Contact);
+  Contact *contacts_ptr = (Contact *)contacts->allocation;
+  for (int i = 0; i < contacts_size; i++) {
+    free(contacts_ptr[i].number);
+    free(contacts_ptr[i].name);
+  }
+  list_free(contacts);
+  list_free(string);
+  trie_free(number_trie);
+  trie_free(t9_name_trie);
+  trie_free(both_trie);
+}
+
+// query_count queries, a quarter of them random digits and the rest prefixes
+// of inserted numbers or T9 names, size the first one at most max_size long,
+// with 32 bytes for each
+char *bench_queries(ArrayList *contacts, int query_count, int max_size,
+                    int *sizes, unsigned *seed) {
+  char *queries = (char *)malloc((size_t)query_count * 32);
+  int contact_count = contacts->size / sizeof(Contact);
+  Contact *contacts_ptr = (Contact *)contacts->allocation;
+  for (int i = 0; i < query_count; i++) {
+    char *query = queries + (size_t)i * 32;
+    *seed = *seed * 1103515245 + 12345;
+    Contact *contact = contacts_ptr + (*seed >> 8) % contact_count;
+    *seed = *seed * 1103515245 + 12345;
+    int size = 1 + (*seed >> 8) % max_size;
+    if (i % 4 == 0) {
+      random_string(query, size, "0123456789", 10, seed);
+    } else if (i % 4 == 1) {
+      memcpy(query, contact->name, strlen(contact->name) + 1);
+      encode_t9(query);
+    } else {
+      memcpy(query, contact->number, strlen(contact->number) + 1);
+    }
+    int length = strlen(query);
+    sizes[i] = size < length ? size : length;
+  }
+  return queries;
+}
+
+// contact_count random contacts inserted into the tries, then query_count
+// prefix lookups in the number and T9 name tries
+void run_bench(int contact_count, int query_count) {
+  unsigned seed = 1;
+  ArrayList contacts = {};
+  ArrayList string = {};
+  Trie number_trie = {};
+  Trie t9_name_trie = {};
+  Trie both_trie = {};
+  trie_init(&number_trie);
+  trie_init(&t9_name_trie);
+  trie_init(&both_trie);
+
+  double start = now_seconds();
+  bench_contacts(&contacts, &string, &number_trie, &t9_name_trie, &both_trie,
+                 contact_count, &seed);
+  double insert_time = now_seconds() - start;
+
+  int *query_sizes = (int *)malloc(query_count * sizeof(int));
+  char *queries =
+      bench_queries(&contacts, query_count, 12, query_sizes, &seed);
+
+  start = now_seconds();
+  int found = 0;
+  for (int i = 0; i < query_count; i++) {
+    const char *query = queries + (size_t)i * 32;
+    found += node_find_prefix(&number_trie, &string, query, query_sizes[i]) !=
+             TRIE_NULL;
+    found += node_find_prefix(&t9_name_trie, &string, query,
+                              query_sizes[i]) != TRIE_NULL;
+  }
+  double query_time = now_seconds() - start;
+
+  int number_nodes = 0;
+  int t9_name_nodes = 0;
+  int both_nodes = 0;
+  size_t bytes = trie_footprint(&number_trie, &number_nodes) +
+                 trie_footprint(&t9_name_trie, &t9_name_nodes) +
+                 trie_footprint(&both_trie, &both_nodes);
+  int node_count = number_nodes + t9_name_nodes + both_nodes;
+#ifdef TRIE_WIDE_NODES
+  const char *layout = "wide";
+#else
+  const char *layout = "adaptive";
+#endif
+  printf("%s nodes, %d contacts, %d nodes\n", layout, contact_count,
+         node_count);
+  printf("  tries      %8.2f MB  %8.1f B/node  %8.1f B/contact\n", bytes / 1e6,
+         (double)bytes / node_count, (double)bytes / contact_count);
+  printf("  insert     %8.4f s   %8.2f M contacts/s\n", insert_time,
+         contact_count / insert_time / 1e6);
+  printf("  lookups    %8.4f s   %8.2f M lookups/s  %d found\n", query_time,
+         2.0 * query_count / query_time / 1e6, found);
+
+  free(queries);
+  free(query_sizes);
+  bench_free(&contacts, &string, &number_trie, &t9_name_trie, &both_trie);
+}
+
+// query_count queries of up to four digits answered from the subtree counts,
+// against collecting and deduplicating the contacts of both subtrees
+void run_query_bench(int contact_count, int query_count) {
+  unsigned seed = 1;
+  ArrayList contacts = {};
+  ArrayList string = {};
+  Trie number_trie = {};
+  Trie t9_name_trie = {};
+  Trie both_trie = {};
+  trie_init(&number_trie);
+  trie_init(&t9_name_trie);
+  trie_init(&both_trie);
+  bench_contacts(&contacts, &string, &number_trie, &t9_name_trie, &both_trie,
+                 contact_count, &seed);
+
+  int *query_sizes = (int *)malloc(query_count * sizeof(int));
+  char *queries = bench_queries(&contacts, query_count, 4, query_sizes, &seed);
+  int *totals = (int *)malloc(query_count * sizeof(int));
+
+  ArrayList stack = {};
+  ArrayList collected = {};
+  double start = now_seconds();
+  long long collected_total = 0;
+  for (int i = 0; i < query_count; i++) {
+    const char *query = queries + (size_t)i * 32;
+    list_reset(&stack);
+    list_reset(&collected);
+    NodeHandle found =
+        node_find_prefix(&number_trie, &string, query, query_sizes[i]);
+    if (found != TRIE_NULL) {
+      collect_children(&number_trie, found, &stack, &collected);
+    }
+    found = node_find_prefix(&t9_name_trie, &string, query, query_sizes[i]);
+    if (found != TRIE_NULL) {
+      collect_children(&t9_name_trie, found, &stack, &collected);
+    }
+    qsort(collected.allocation, collected.size / sizeof(int), sizeof(int),
+          compare_ints);
+    totals[i] =
+        int_dedup((int *)collected.allocation, collected.size / sizeof(int));
+    collected_total += totals[i];
+  }
+  double collect_time = now_seconds() - start;
+
+  start = now_seconds();
+  long long counted_total = 0;
+  int mismatches = 0;
+  for (int i = 0; i < query_count; i++) {
+    const char *query = queries + (size_t)i * 32;
+    NodeHandle number_found = TRIE_NULL;
+    NodeHandle t9_found = TRIE_NULL;
+    int total = query_total(&string, &number_trie, &t9_name_trie, &both_trie,
+                            query, query_sizes[i], &number_found, &t9_found);
+    mismatches += total != totals[i];
+    counted_total += total;
+  }
+  double count_time = now_seconds() - start;
+
+  printf("%d contacts, %d queries, %.1f contacts per query\n", contact_count,
+         query_count, (double)collected_total / query_count);
+  printf("  collect    %8.4f s\n", collect_time);
+  printf("  counts     %8.4f s  %8.1fx\n", count_time,
+         collect_time / count_time);
+  if (mismatches > 0 || counted_total != collected_total) {
+    printf("MISMATCH in %d queries\n", mismatches);
+  }
+
+  free(queries);
+  free(query_sizes);
+  free(totals);
+  list_free(&stack);
+  list_free(&collected);
+  bench_free(&contacts, &string, &number_trie, &t9_name_trie, &both_trie);
 }
+#endif /* __PROGTEST__ */
 
-int main() {
+int main(int argc, char *argv[]) {
   populate_luts();
+#ifndef __PROGTEST__
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    int contact_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    int query_count = argc > 3 ? atoi(argv[3]) : 4000000;
+    if (contact_count < 1 || query_count < 1) {
+      printf("usage: %s --bench [contacts [queries]]\n", argv[0]);
+      return 1;
+    }
+    run_bench(contact_count, query_count);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-query") == 0) {
+    int contact_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    int query_count = argc > 3 ? atoi(argv[3]) : 1000;
+    if (contact_count < 1 || query_count < 1) {
+      printf("usage: %s --bench-query [contacts [queries]]\n", argv[0]);
+      return 1;
+    }
+    run_query_bench(contact_count, query_count);
+    return 0;
+  }
+#else
+  (void)argc;
+  (void)argv;
+#endif /* __PROGTEST__ */
 
   ArrayList contacts = {};
   ArrayList stack = {};
@@ -495,9 +1120,11 @@ int main() {
   ArrayList string = {};
   Trie number_trie = {};
   Trie t9_name_trie = {};
+  Trie both_trie = {};
 
   trie_init(&number_trie);
   trie_init(&t9_name_trie);
+  trie_init(&both_trie);
 
   char *line = NULL;
   size_t line_len = 0;
@@ -505,11 +1132,12 @@ int main() {
   while (getline(&line, &line_len, stdin) > 0) {
     switch (*line) {
     case '+':
-      add_number(line, &contacts, &string, &number_trie, &t9_name_trie);
+      add_number(line, &contacts, &string, &number_trie, &t9_name_trie,
+                 &both_trie);
       break;
     case '?':
       do_query(line, &contacts, &stack, &collected, &string, &number_trie,
-               &t9_name_trie);
+               &t9_name_trie, &both_trie);
       break;
     case '\0':
       DEBUG("EOF\n");
@@ -535,5 +1163,6 @@ int main() {
   list_free(&string);
   trie_free(&number_trie);
   trie_free(&t9_name_trie);
+  trie_free(&both_trie);
   return 0;
 }